@@ -12,6 +12,11 @@
 #include "lzma_wrapper.h"
 
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 using namespace std;
 
@@ -20,23 +25,216 @@ CApplication::CApplication(const CParams &_params)
 {
 	params = _params;
 
-	// To avoid unnecessary reallocation of buffers
-	v_vcf_data_compress.reserve(no_variants_in_buf);
-	v_vcf_data_io.reserve(no_variants_in_buf);
+	// A quarter of threads is given to the htslib pool (BGZF only), the rest to our threads and the shared pool,
+	// so at most params.no_threads threads are busy
+	no_hts_threads = params.no_threads / 4;
+	no_work_threads = params.no_threads - no_hts_threads;
+
+	CVCF::SetNoThreads(no_hts_threads);
 }
 
 // ******************************************************************************
 CApplication::~CApplication()
 {
+	// All VCF files are closed at this point
+	CVCF::ReleaseThreads();
+}
+
+// ******************************************************************************
+bool CApplication::init_block_ranges(CCompressedFile &cfile)
+{
+	v_block_ranges.clear();
+	i_block_range = 0;
+	block_range_end = 0;
+
+	if (params.v_regions.empty())
+	{
+		v_block_ranges.push_back(make_pair(0u, cfile.GetNoBlocks()));
+		return true;
+	}
+
+	return cfile.GetBlocksForRegions(params.v_regions, v_block_ranges);
+}
+
+// ******************************************************************************
+bool CApplication::in_regions(const variant_desc_view_t &desc)
+{
+	if (params.v_regions.empty())
+		return true;
+
+	for (auto &r : params.v_regions)
+		if (r.start <= desc.pos && desc.pos <= r.end && r.chrom.compare(0, string::npos, desc.chrom.data, desc.chrom.size) == 0)
+			return true;
+
+	return false;
+}
+
+// ******************************************************************************
+// Decode blocks from v_block_ranges in parallel and write variants (from regions) in the order of blocks.
+// Descriptions are views into the description columns of blocks, which are kept by parts till they are written.
+bool CApplication::decode_blocks(const function<bool(uint32_t, CBlockReader&)> &start_block,
+	const function<bool(CBlockReader&, variant_desc_view_t&, vector<uint8_t>&)> &read_variant,
+	const function<void(variant_desc_view_t&, vector<uint8_t>&)> &write_variant)
+{
+	vector<uint32_t> v_block_ids;
+	for (auto &r : v_block_ranges)
+		for (uint32_t i = r.first; i < r.second; ++i)
+			v_block_ids.push_back(i);
+
+	// Part of variants of a single block
+	typedef struct {
+		shared_ptr<const desc_column_data_t> desc_columns;
+		vector<pair<variant_desc_view_t, vector<uint8_t>>> v_variants;
+	} decoded_part_t;
+
+	// Reorder buffer: blocks are decoded in parts by many threads, but the parts are written in the order of blocks
+	typedef struct {
+		deque<decoded_part_t*> q_parts;
+		bool completed;
+	} block_parts_t;
+
+	const size_t max_parts_in_block = 2;
+	vector<block_parts_t> v_block_parts(v_block_ids.size(), block_parts_t{ deque<decoded_part_t*>(), false });
+	vector<decoded_part_t*> v_free_parts;
+	size_t i_block_to_decode = 0;
+	size_t i_block_to_write = 0;
+	mutex mtx_rob;
+	condition_variable cv_rob;
+	bool ok = true;
+
+	// Threads making rev-PBWT and decompressing data (each decodes whole blocks; the calling thread is the writer).
+	// They wait when the writer lags, so they are not run in the shared pool (its workers would be blocked).
+	uint32_t no_decoding_threads = no_threads_besides(1);
+	vector<thread> v_threads;
+	v_threads.reserve(no_decoding_threads);
+
+	for (uint32_t t = 0; t < no_decoding_threads; ++t)
+		v_threads.push_back(thread([&] {
+			CBlockReader reader;
+
+			while (true)
+			{
+				size_t i_block;
+				decoded_part_t *part;
+
+				{
+					lock_guard<mutex> lck(mtx_rob);
+					if (i_block_to_decode == v_block_ids.size())
+						break;
+					i_block = i_block_to_decode++;
+				}
+
+				if (!start_block(v_block_ids[i_block], reader))
+				{
+					lock_guard<mutex> lck(mtx_rob);
+					v_block_parts[i_block].completed = true;
+					ok = false;
+					cv_rob.notify_all();
+					continue;
+				}
+
+				bool completed = false;
+				while (!completed)
+				{
+					{
+						lock_guard<mutex> lck(mtx_rob);
+						if (v_free_parts.empty())
+						{
+							part = new decoded_part_t;
+							part->v_variants.reserve(no_variants_in_buf);
+						}
+						else
+						{
+							part = v_free_parts.back();
+							v_free_parts.pop_back();
+						}
+					}
+
+					part->desc_columns = reader.DescColumns();
+
+					auto &v_variants = part->v_variants;
+					size_t part_size = 0;
+					while (part_size < no_variants_in_buf)
+					{
+						if (part_size == v_variants.size())
+							v_variants.emplace_back();
+
+						auto &x = v_variants[part_size];
+						if (!read_variant(reader, x.first, x.second))
+						{
+							completed = true;
+							break;
+						}
+
+						if (in_regions(x.first))
+							++part_size;
+					}
+					v_variants.resize(part_size);
+
+					unique_lock<mutex> lck(mtx_rob);
+					if (completed && reader.Failed())
+					{
+						cerr << "Corrupted block " << v_block_ids[i_block] << endl;
+						ok = false;
+					}
+					cv_rob.wait(lck, [&] {return v_block_parts[i_block].q_parts.size() < max_parts_in_block; });
+					v_block_parts[i_block].q_parts.push_back(part);
+					v_block_parts[i_block].completed = completed;
+					cv_rob.notify_all();
+				}
+			}
+		}));
+
+	// Writing variants in the order of blocks
+	size_t no_variants = 0;
+	while (i_block_to_write < v_block_ids.size())
+	{
+		decoded_part_t *part;
+
+		{
+			unique_lock<mutex> lck(mtx_rob);
+			auto &bp = v_block_parts[i_block_to_write];
+
+			cv_rob.wait(lck, [&] {return !bp.q_parts.empty() || bp.completed; });
+			if (bp.q_parts.empty())
+			{
+				++i_block_to_write;
+				continue;
+			}
+
+			part = bp.q_parts.front();
+			bp.q_parts.pop_front();
+			cv_rob.notify_all();
+		}
+
+		for (auto &x : part->v_variants)
+			write_variant(x.first, x.second);
+
+		no_variants += part->v_variants.size();
+		cout << no_variants << "\r";
+		fflush(stdout);
+
+		// Columns of the block are released when its last part is written
+		part->desc_columns.reset();
+
+		lock_guard<mutex> lck(mtx_rob);
+		v_free_parts.push_back(part);
+	}
+
+	for (auto &t : v_threads)
+		t.join();
+
+	for (auto p : v_free_parts)
+		delete p;
+
+	return ok;
 }
 
 // ******************************************************************************
 bool CApplication::CompressDB()
 {
-	CBarrier barrier(3);
 	unique_ptr<CVCF> vcf(new CVCF());
 	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
-	bool end_of_processing = false;
 
 	if (!vcf->OpenForReading(params.vcf_file_name))
 	{
@@ -50,6 +248,8 @@ bool CApplication::CompressDB()
 	bool ploidy_initialised = false;
 
 	cfile->SetNeglectLimit(params.neglect_limit);
+	cfile->SetNoVariantsInBlock(params.no_variants_in_block);
+	cfile->SetNoThreads(no_threads_besides(2));		// the VCF reader and PBWT threads are busy too
 	cfile->SetNoSamples(vcf->GetNoSamples());
 
 	string header;
@@ -60,63 +260,46 @@ bool CApplication::CompressDB()
 	cfile->SetHeader(header);
 	cfile->AddSamples(v_samples);
 
-	// Thread reading VCF files in parts
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
-		{
-			v_vcf_data_io.clear();
-
-			for (size_t i = 0; i < no_variants_in_buf; ++i)
-			{
-  				v_vcf_data_io.push_back(make_pair(variant_desc_t(), vector<uint8_t>()));
-				if (!vcf->GetVariant(v_vcf_data_io.back().first, v_vcf_data_io.back().second))
-				{
-					v_vcf_data_io.pop_back();
-					break;
-				}
-			}
+	// Parts of VCF file are read in the calling thread while PBWT is made for the previous ones (the order of parts is kept)
+	CPipeline<vcf_part_t> pipeline(no_vcf_parts_in_progress);
+	size_t no_variants = 0;
 
-			if (!ploidy_initialised)
-			{
-				cfile->SetPloidy(vcf->GetPloidy());
-				cfile->InitPBWT();
-				ploidy_initialised = true;
-			}
+	pipeline.SetSource([&](vcf_part_t &part) {
+		// Buffers of recycled parts are reused
+		part.resize(no_variants_in_buf);
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+		size_t part_size = 0;
+		for (; part_size < no_variants_in_buf; ++part_size)
+		{
+			part[part_size].second.clear();
+			if (!vcf->GetVariant(part[part_size].first, part[part_size].second))
+				break;
 		}
-	}));
+		part.resize(part_size);
 
-	// Thread making PBWT and compressing data
-	unique_ptr<thread> t_vcf(new thread([&] {
-		while (!end_of_processing)
+		if (!ploidy_initialised)
 		{
-			for (size_t i = 0; i < v_vcf_data_compress.size(); ++i)
-				cfile->SetVariant(v_vcf_data_compress[i].first, v_vcf_data_compress[i].second);
-
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+			cfile->SetPloidy(vcf->GetPloidy());
+			cfile->InitPBWT();
+			ploidy_initialised = true;
 		}
-	}));
 
-	// Synchronization
-	size_t no_variants = 0;
-	while (!end_of_processing)
-	{
-		barrier.count_down_and_wait();
-		swap(v_vcf_data_compress, v_vcf_data_io);
-		if (v_vcf_data_compress.empty())
-			end_of_processing = true;
+		return !part.empty();
+	});
+
+	// Making PBWT and compressing data (blocks are coded by threads of cfile)
+	pipeline.AddStage([&](vcf_part_t &part) {
+		for (auto &x : part)
+			cfile->SetVariant(x.first, x.second);
 
-		no_variants += v_vcf_data_compress.size();
+		no_variants += part.size();
 		cout << no_variants << "\r";
 		fflush(stdout);
-		barrier.count_down_and_wait();
-	}
 
-	t_vcf->join();
-	t_io->join();
+		return true;
+	});
+
+	pipeline.Run();
 
 	cfile->Close();
 	vcf->Close();
@@ -128,10 +311,8 @@ bool CApplication::CompressDB()
 // ******************************************************************************
 bool CApplication::DecompressDB()
 {
-	CBarrier barrier(3);
 	unique_ptr<CVCF> vcf(new CVCF());
 	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
-	bool end_of_processing = false;
 
 	if (!vcf->OpenForWriting(params.vcf_file_name, params.out_type, params.bcf_compression_level))
 	{
@@ -139,87 +320,97 @@ bool CApplication::DecompressDB()
 		return false;
 	}
 
+	cfile->SetNoThreads(no_work_threads);
+	cfile->SetDescFields(params.drop_info ? (df_all & ~df_info) : df_all);
 	if (!cfile->OpenForReading(params.db_file_name))
 		return false;
 
-	cfile->InitPBWT();
 	params.neglect_limit = cfile->GetNeglectLimit();
 
-	uint32_t no_variants = cfile->GetNoVariants();
-	uint32_t i_variant = 0;
-
 	string header;
 	vector<string> v_samples;
 
 	cfile->GetHeader(header);
-	cfile->GetSamples(v_samples);
+	if (!params.sites_only)
+		cfile->GetSamples(v_samples);
 	vcf->SetHeader(header);
 	vcf->AddSamples(v_samples);
 	vcf->WriteHeader();
 
 	vcf->SetPloidy(cfile->GetPloidy());
 
-	// Thread making rev-PBWT and decompressing data
-	unique_ptr<thread> t_vcf(new thread([&] {
-		while (!end_of_processing)
-		{
-			v_vcf_data_compress.clear();
+	init_block_ranges(*cfile);
+
+	bool r;
+
+	if (params.sites_only)
+		r = decode_blocks([&](uint32_t block_id, CBlockReader &reader) {
+				return cfile->StartBlockDescReading(block_id, reader);
+			}, [&](CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data) {
+				data.clear();
+				return cfile->ReadBlockVariantDesc(reader, desc);
+			}, [&](variant_desc_view_t &desc, vector<uint8_t> &data) {
+				vcf->SetVariant(desc, data);
+			});
+	else
+		r = decode_blocks([&](uint32_t block_id, CBlockReader &reader) {
+				return cfile->StartBlockReading(block_id, reader);
+			}, [&](CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data) {
+				return cfile->ReadBlockVariant(reader, desc, data);
+			}, [&](variant_desc_view_t &desc, vector<uint8_t> &data) {
+				vcf->SetVariant(desc, data);
+			});
 
-			for (size_t i = 0; i < no_variants_in_buf && i_variant < no_variants; ++i, ++i_variant)
-			{
-				v_vcf_data_compress.push_back(make_pair(variant_desc_t(), vector<uint8_t>()));
-				cfile->GetVariant(v_vcf_data_compress.back().first, v_vcf_data_compress.back().second);
-			}
-			
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-		}
-	}));
+	cfile->Close();
+	vcf->Close();
+	cout << endl;
 
-	// Thread writing VCF files in parts
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
-		{
-			for (size_t i = 0; i < v_vcf_data_io.size(); ++i)
-				vcf->SetVariant(v_vcf_data_io[i].first, v_vcf_data_io[i].second);
-			v_vcf_data_io.clear();
+	return r;
+}
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-		}
-	}));
+// ******************************************************************************
+bool CApplication::ExtractSample()
+{
+	vector<string> v_ids{ params.id_sample };
 
-	// Synchronization
-	while (!end_of_processing)
-	{
-		barrier.count_down_and_wait();
-		swap(v_vcf_data_compress, v_vcf_data_io);
-		if (v_vcf_data_io.empty())
-			end_of_processing = true;
+	return extract_samples(v_ids);
+}
 
-		cout << i_variant << "\r";
-		fflush(stdout);
-		barrier.count_down_and_wait();
+// ******************************************************************************
+bool CApplication::ExtractSamples()
+{
+	vector<string> v_ids;
+	ifstream ifs(params.sample_list_file_name);
+	string id;
+
+	if (!ifs.is_open())
+	{
+		cerr << "Cannot open: " << params.sample_list_file_name << endl;
+		return false;
 	}
 
-	t_vcf->join();
-	t_io->join();
+	while (getline(ifs, id))
+	{
+		id = trim(id);
+		if (!id.empty())
+			v_ids.push_back(id);
+	}
 
-	cfile->Close();
-	vcf->Close();
-	cout << endl;
+	if (v_ids.empty())
+	{
+		cerr << "No samples in: " << params.sample_list_file_name << endl;
+		return false;
+	}
 
-	return true;
+	return extract_samples(v_ids);
 }
 
 // ******************************************************************************
-bool CApplication::ExtractSample()
+// Extract many samples in a single pass; haplotypes of all samples are tracked together
+bool CApplication::extract_samples(vector<string> &v_ids)
 {
-	CBarrier barrier(3);
 	unique_ptr<CVCF> vcf(new CVCF());
 	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
-	bool end_of_processing = false;
-	vector<pair<uint8_t, uint32_t>> rle_genotypes;
 
 	if (!vcf->OpenForWriting(params.vcf_file_name, params.out_type, params.bcf_compression_level))
 	{
@@ -227,757 +418,957 @@ bool CApplication::ExtractSample()
 		return false;
 	}
 
+	cfile->SetNoThreads(no_work_threads);
+	cfile->SetDescFields(params.drop_info ? (df_all & ~df_info) : df_all);
 	if (!cfile->OpenForReading(params.db_file_name))
 		return false;
 
-	cfile->InitPBWT();
 	params.neglect_limit = cfile->GetNeglectLimit();
 
-	uint32_t no_variants = cfile->GetNoVariants();
-	uint32_t i_variant = 0;
-
 	string header;
 	vector<string> v_samples;
 
 	cfile->GetHeader(header);
 	cfile->GetSamples(v_samples);
 	vcf->SetHeader(header);
-	vcf->AddSample(params.id_sample);
+	vcf->AddSamples(v_ids);
 	vcf->WriteHeader();
 
-	auto p = find(v_samples.begin(), v_samples.end(), params.id_sample);
-	if (p == v_samples.end())
-	{
-		cerr << "Sample: " << params.id_sample << " does not exist\n";
-		return false;
-	}
+	unordered_map<string, uint32_t> m_samples;
+	for (uint32_t i = 0; i < v_samples.size(); ++i)
+		m_samples.insert(make_pair(v_samples[i], i));
 
 	uint32_t ploidy = cfile->GetPloidy();
-	array<uint32_t, 2> sample_pos;
-	array<uint32_t, 2> sample_pos_perm;
-	array<uint8_t, 2> val{ 0,0 };
+	vector<uint32_t> v_sample_items;
 
-	if (ploidy == 1)
-		sample_pos[0] = (uint32_t) (p - v_samples.begin());
-	else if (ploidy == 2)
+	for (auto &id : v_ids)
 	{
-		sample_pos[0] = 2u * (uint32_t) (p - v_samples.begin());
-		sample_pos[1] = sample_pos[0] + 1;
+		auto p = m_samples.find(id);
+		if (p == m_samples.end())
+		{
+			cerr << "Sample: " << id << " does not exist\n";
+			return false;
+		}
+
+		for (uint32_t j = 0; j < ploidy; ++j)
+			v_sample_items.push_back(ploidy * p->second + j);
 	}
-	sample_pos_perm = sample_pos;
 
 	vcf->SetPloidy(ploidy);
 
-	// Thread making rev-PBWT and decompressing data
-	unique_ptr<thread> t_vcf(new thread([&] {
-		while (!end_of_processing)
-		{
-			v_vcf_data_compress.clear();
+	init_block_ranges(*cfile);
 
-			for (size_t i = 0; i < no_variants_in_buf && i_variant < no_variants; ++i, ++i_variant)
-			{
-				v_vcf_data_compress.push_back(make_pair(variant_desc_t(), vector<uint8_t>()));
-				cfile->GetVariantGenotypesRawAndDesc(v_vcf_data_compress.back().first, rle_genotypes);
+	// Haplotypes of the samples are tracked from the ranks stored at the beginning of each block
+	bool r = decode_blocks([&](uint32_t block_id, CBlockReader &reader) {
+			return cfile->StartBlockTracking(block_id, v_sample_items, reader);
+		}, [&](CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data) {
+			if (!cfile->ReadBlockVariantTracked(reader, desc, data))
+				return false;
 
-				uint8_t variant_data = 0u;
-
-				if (ploidy == 1)
-					cfile->TrackItem(rle_genotypes, sample_pos_perm[0], val[0], sample_pos_perm[0]);
-				else if (ploidy == 2)
-				{
-					cfile->TrackItems(rle_genotypes, sample_pos_perm, val, sample_pos_perm);
-					variant_data = 0b00010000u;		// Data phased
-				}
+			if (ploidy == 2)
+				for (size_t i = 0; i < v_ids.size(); ++i)
+					data[i] = (uint8_t) (0b00010000u + data[2 * i] + (data[2 * i + 1] << 2));		// Data phased
 
-//				variant_data += (uint8_t) (val[0] + (val[1] << 2));
-				variant_data += (uint8_t) val[0];
-				variant_data += (uint8_t) ((int) val[1] << 2);
+			data.resize(v_ids.size());
 
-				v_vcf_data_compress.back().second.push_back(variant_data);
-			}
+			return true;
+		}, [&](variant_desc_view_t &desc, vector<uint8_t> &data) {
+			vcf->SetVariant(desc, data);
+		});
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-		}
-	}));
+	cfile->Close();
+	vcf->Close();
+	cout << endl;
+	
+	return r;
+}
 
-	// Thread writing VCF files in parts
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
-		{
-			for (size_t i = 0; i < v_vcf_data_io.size(); ++i)
-				vcf->SetVariant(v_vcf_data_io[i].first, v_vcf_data_io[i].second);
-			v_vcf_data_io.clear();
+// ******************************************************************************
+// Allele counts are taken directly from the run-length encoded rows, so the PBWT is not reversed
+bool CApplication::Stats()
+{
+	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
+	COutFile out;
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
-		}
-	}));
+	cfile->SetNoThreads(no_work_threads);
+	cfile->SetDescFields(df_id | df_ref_alt);
+	if (!cfile->OpenForReading(params.db_file_name))
+		return false;
 
-	// Synchronization
-	while (!end_of_processing)
+	if (!out.Open(params.vcf_file_name))
 	{
-		barrier.count_down_and_wait();
-		swap(v_vcf_data_compress, v_vcf_data_io);
-		if (v_vcf_data_io.empty())
-			end_of_processing = true;
-
-		cout << i_variant << "\r";
-		fflush(stdout);
-		barrier.count_down_and_wait();
+		cerr << "Cannot open: " << params.vcf_file_name << endl;
+		return false;
 	}
 
-	t_vcf->join();
-	t_io->join();
+	string header = "#CHROM\tPOS\tID\tREF\tALT\tAC\tAN\tAF\tMISSING\n";
+	out.Write(header);
+
+	init_block_ranges(*cfile);
+
+	// Each variant is formatted by the decoding thread; the writer only copies lines to the output
+	bool r = decode_blocks([&](uint32_t block_id, CBlockReader &reader) {
+			return cfile->StartBlockReading(block_id, reader);
+		}, [&](CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data) {
+			thread_local vector<run_desc_t> v_rle;
+
+			if (!cfile->ReadBlockVariantRaw(reader, desc, v_rle))
+				return false;
+
+			// Symbols: 0 - REF, 1 - ALT, 2 - other ALT of multi-allelic variant, 3 - missing
+			uint32_t counts[4] = { 0, 0, 0, 0 };
+			for (auto &x : v_rle)
+				counts[x.first & 3] += x.second;
+
+			uint32_t ac = counts[1];
+			uint32_t an = counts[0] + counts[1] + counts[2];
+			uint32_t total = an + counts[3];
+
+			// Fields are appended directly to the line (no temporary strings)
+			auto append = [&data](const char *str, size_t len) {
+				data.insert(data.end(), (const uint8_t *) str, (const uint8_t *) str + len);
+			};
+
+			char buf[128];
+			int len;
+
+			data.clear();
+			append(desc.chrom.data, desc.chrom.size);
+			len = snprintf(buf, sizeof(buf), "\t%lld\t", (long long) desc.pos);
+			append(buf, len);
+			append(desc.id.data, desc.id.size);
+			append("\t", 1);
+			append(desc.ref.data, desc.ref.size);
+			append("\t", 1);
+			append(desc.alt.data, (size_t) (find(desc.alt.data, desc.alt.data + desc.alt.size, ',') - desc.alt.data));
+
+			if (an)
+				len = snprintf(buf, sizeof(buf), "\t%u\t%u\t%.6g\t%.6g\n", ac, an, (double) ac / an, total ? (double) counts[3] / total : 0.0);
+			else
+				len = snprintf(buf, sizeof(buf), "\t%u\t%u\t.\t%.6g\n", ac, an, total ? (double) counts[3] / total : 0.0);
+			append(buf, len);
+
+			return true;
+		}, [&](variant_desc_view_t &, vector<uint8_t> &data) {
+			out.Write(data.data(), data.size());
+		});
 
 	cfile->Close();
-	vcf->Close();
+	if (!out.Close())
+	{
+		cerr << "Cannot write: " << params.vcf_file_name << endl;
+		r = false;
+	}
 	cout << endl;
-	
-	return true;
+
+	return r;
 }
 
 // ******************************************************************************
-bool CApplication::find_prev_value(const vector<run_desc_t> &v_rle_genotypes, const uint32_t max_pos, const uint8_t value, uint32_t &found_pos)
+// Rows of the database are decoded in batches shared by all samples of a pass; next batches are decoded while the current one is processed.
+// The divergence array of the database is updated along with decoding; arrays before rows permuting haplotypes are given with the rows.
+// process_batch returns false when no more rows are needed. oldest_row_id gives the oldest row still in use (given the first row of the next batch).
+void CApplication::process_row_batches(CCompressedFile &cfile, bool with_desc,
+	const function<bool(vector<db_row_t>&, size_t, bool)> &process_batch,
+	const function<uint64_t(uint64_t)> &oldest_row_id)
 {
-	bool found = false;
-	found_pos = 0;
-	uint32_t cur_pos = 0;
+	CRowStore row_store;
+	mutex mtx_rows;				// rows are added by the source and released after processing of batches
+	size_t no_haplotypes = (size_t) cfile.GetNoSamples() * cfile.GetPloidy();
+	CPBWTDivergence divergence(no_haplotypes, cfile.GetNeglectLimit());
+	uint32_t no_variants = cfile.GetNoVariants();
+	uint32_t i_variant = 0;
+	bool last_made = false;
 
-	for (auto run : v_rle_genotypes)
-	{
-		if (run.first == value)
+	CPipeline<row_batch_t> pipeline(no_row_batches_in_progress);
+
+	// The last batch is made even if it is empty, so the samples can be finished
+	pipeline.SetSource([&](row_batch_t &batch) {
+		if (last_made)
+			return false;
+
+		batch.v_rows.resize(no_rows_in_batch);
+		size_t div_size = 0;
+
+		for (batch.no_rows = 0; batch.no_rows < batch.v_rows.size() && i_variant < no_variants && div_size < max_divergence_size_in_batch;
+			++batch.no_rows, ++i_variant)
 		{
-			if (cur_pos + run.second >= max_pos)
+			auto &x = batch.v_rows[batch.no_rows];
+			CRLERow *row;
 			{
-				found_pos = max_pos - 1;
-				cur_pos = max_pos;
-				found = true;
+				lock_guard<mutex> lck(mtx_rows);
+				x.id = row_store.NextId();
+				row = row_store.Add();
 			}
-			else
+			x.row = row;
+
+			if (!(with_desc ? cfile.GetVariantGenotypesRawAndDesc(x.desc, *row) : cfile.GetVariantGenotypesRaw(*row)))
 			{
-				found_pos = cur_pos + run.second - 1;
-				cur_pos += run.second;
-				found = true;
+				no_variants = i_variant;
+				break;
 			}
+
+			x.div = divergence.Add(*row);
+			if (x.div)
+				div_size += no_haplotypes * sizeof(uint32_t);
 		}
-		else
-			cur_pos += run.second;
 
-		if (cur_pos >= max_pos)
-			break;
-	}
+		// Rows left from the previous use of the batch release their arrays
+		for (size_t i = batch.no_rows; i < batch.v_rows.size(); ++i)
+			batch.v_rows[i].div.reset();
+
+		lock_guard<mutex> lck(mtx_rows);
+		batch.next_id = row_store.NextId();
+		batch.last = last_made = i_variant >= no_variants;
+
+		return true;
+	});
+
+	pipeline.AddStage([&](row_batch_t &batch) {
+		bool more_rows_needed = process_batch(batch.v_rows, batch.no_rows, batch.last);
+
+		cout << batch.next_id << "\r";
+		fflush(stdout);
+
+		if (!more_rows_needed || batch.last)
+			return false;
+
+		// Rows no longer in use can be reused
+		uint64_t min_id = oldest_row_id(batch.next_id);
+
+		lock_guard<mutex> lck(mtx_rows);
+		row_store.Release(min_id);
 
-	return found;
+		return true;
+	});
+
+	pipeline.Run();
+}
+
+// ******************************************************************************
+bool CApplication::CompressSample()
+{
+	return compress_samples(vector<string>{ params.vcf_file_name }, [&](const string &) {
+		return params.sample_file_name;
+	}, true);
 }
 
 // ******************************************************************************
-bool CApplication::find_next_value(const vector<run_desc_t> &v_rle_genotypes, const uint32_t min_pos, const uint8_t value, uint32_t &found_pos)
+bool CApplication::CompressSamples()
 {
-	bool found = false;
-	found_pos = 0;
-	uint32_t cur_pos = 0;
+	vector<string> v_input_names;
 
-	for (auto run : v_rle_genotypes)
+	if (params.input_vcf_list)
 	{
-		if (run.first == value)
+		ifstream ifs(params.vcf_file_name);
+		string name;
+
+		if (!ifs.is_open())
 		{
-			if (cur_pos + run.second >= min_pos)
-			{
-				found_pos = min_pos;
-				found = true;
-				cur_pos = min_pos;
-			}
-			else if (cur_pos >= min_pos)
-			{
-				found_pos = min_pos;
-				found = true;
-			}
-			else
-				cur_pos += run.second;
+			cerr << "Cannot open: " << params.vcf_file_name << endl;
+			return false;
 		}
-		else
-			cur_pos += run.second;
 
-		if (cur_pos >= min_pos && found)
-			break;
+		while (getline(ifs, name))
+		{
+			name = trim(name);
+			if (!name.empty())
+				v_input_names.push_back(name);
+		}
+
+		if (v_input_names.empty())
+		{
+			cerr << "No files in: " << params.vcf_file_name << endl;
+			return false;
+		}
 	}
+	else
+		v_input_names.push_back(params.vcf_file_name);
 
-	return found;
-}
+	auto output_name = [&](const string &sample_name) {
+		return params.sample_file_name + "/" + sample_name;
+	};
 
-// ******************************************************************************
-bool CApplication::CompressSample()
-{
-	CBarrier barrier(3);
-	unique_ptr<CSampleFile> sfile(new CSampleFile());
-	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
-	unique_ptr<CVCF> vfile(new CVCF());
-	bool end_of_processing = false;
-	vector<run_desc_t> rle_genotypes;
+	if (!params.sample_container)
+		return compress_samples(v_input_names, output_name, false);
+
+	CSampleContainer container;
 
-	if (!sfile->OpenForWriting(params.sample_file_name, params.extra_variants))
+	if (!container.OpenForAppending(params.sample_file_name))
 	{
 		cerr << "Cannot open: " << params.sample_file_name << endl;
 		return false;
 	}
 
-	if (!vfile->OpenForReading(params.vcf_file_name))
-	{
-		cerr << "Cannot open: " << params.vcf_file_name << endl;
+	// On failure the container is closed with the samples appended so far
+	if (!compress_samples(v_input_names, output_name, false, &container))
 		return false;
-	}
 
-	if (!cfile->OpenForReading(params.db_file_name))
+	if (!container.Close())
+	{
+		cerr << "Cannot write: " << params.sample_file_name << endl;
 		return false;
+	}
 
-	cfile->InitPBWT();
-	params.neglect_limit = cfile->GetNeglectLimit();
-
-	uint32_t no_variants = cfile->GetNoVariants();
-	uint32_t i_variant = 0;
+	return true;
+}
 
-	string header, v_header;
-	vector<string> v_samples, cur_sample;
+// ******************************************************************************
+// Samples are compressed in passes over the database (of at most max_samples_in_pass samples).
+// Each row is decoded once in a pass and shared by trackers of all samples, so the compressed samples
+// are the same as obtained by compressing them one by one.
+// Samples stored in a container are appended to it after each pass in the order of the input, so the container does not depend on the no. of threads.
+bool CApplication::compress_samples(const vector<string> &v_input_names, const function<string(const string&)> &output_name, bool single_sample,
+	CSampleContainer *container)
+{
+	unordered_set<string> s_output_names;
+	string empty_header;
 
-	vector<uint8_t> v_ev_flags_compress, v_ev_flags_io;
-	vector<pair<variant_desc_t, vector<uint8_t>>> v_ev_desc;
+	size_t i_input = 0;
+	uint32_t first_column = 0;
 
-	cfile->GetHeader(header);
-	cfile->GetSamples(v_samples);
-	vfile->GetHeader(v_header);
-	vfile->GetSamplesList(cur_sample);
-	
-	if (cur_sample.size() != 1)
+	while (i_input < v_input_names.size())
 	{
-		cerr << "File to compress must contain exactly 1 sample\n";
-		return false;
-	}
+		unique_ptr<CCompressedFile> cfile(new CCompressedFile());
 
-	string empty_header;
-	sfile->WriteHeaderAndSample(header, params.store_sample_header ? v_header : empty_header, cur_sample.front());
+		cfile->SetNoThreads(no_work_threads);
+		cfile->SetDescFields(0);			// only CHROM and POS are used to match variants
+		if (!cfile->OpenForReading(params.db_file_name))
+			return false;
 
-	uint32_t ploidy = cfile->GetPloidy();
-	array<uint32_t, 2> sample_pos;
-	array<uint32_t, 2> sample_pos_perm;
-	uint32_t no_pred_same[2] = { 0, 0 };
-	uint32_t no_succ_same[2] = { 0, 0 };
-
-	if (ploidy == 1)
-		sample_pos[0] = (uint32_t) v_samples.size();
-	else if (ploidy == 2)
-	{
-		sample_pos[0] = 2u * (uint32_t) v_samples.size();
-		sample_pos[1] = sample_pos[0];
-	}
-	sample_pos_perm = sample_pos;
+		cfile->InitPBWT();
+		params.neglect_limit = cfile->GetNeglectLimit();
 
-	bool v_eof = false;
-	bool c_eof = false;
+		string header;
+		cfile->GetHeader(header);
 
-	// Thread making rev-PBWT and estimating the position of sample to process
-	unique_ptr<thread> t_vcf(new thread([&] {
-		variant_desc_t v_desc, c_desc;
-		vector<uint8_t> v_data;
+		vector<sample_input_t> v_inputs;
+		vector<sample_output_t> v_outputs;
 
-		while (!end_of_processing)
+		// Files (or parts of multi-sample files) processed in the pass
+		while (i_input < v_input_names.size() && v_outputs.size() < max_samples_in_pass)
 		{
-			bool need_new_c_variant = true;
-			bool need_new_v_variant = true;
+			string input_name = v_input_names[i_input];
+			unique_ptr<CVCF> vfile(new CVCF());
+			string v_header;
+			vector<string> v_samples;
 
-			v_vcf_data_compress.clear();
-			v_ev_flags_compress.clear();
+			if (!vfile->OpenForReading(input_name))
+			{
+				cerr << "Cannot open: " << input_name << endl;
+				return false;
+			}
+
+			vfile->GetHeader(v_header);
+			vfile->GetSamplesList(v_samples);
 
-			for (size_t i = 0; i < no_variants_in_buf && (!v_eof || !c_eof);)
+			if (single_sample && v_samples.size() != 1)
 			{
-				if (params.extra_variants)
+				cerr << "File to compress must contain exactly 1 sample\n";
+				return false;
+			}
+
+			uint32_t end_column = (uint32_t) min<size_t>(v_samples.size(), first_column + max_samples_in_pass - v_outputs.size());
+
+			if (first_column < end_column)
+			{
+				v_inputs.emplace_back();
+				v_inputs.back().vfile = move(vfile);
+				v_inputs.back().no_samples = (uint32_t) v_samples.size();
+
+				for (uint32_t j = first_column; j < end_column; ++j)
 				{
-					if (need_new_c_variant)
+					// Samples of a container are kept in memory till the end of the pass
+					string sample_file_name = container ? string() : output_name(v_samples[j]);
+					size_t member_id;
+
+					if (!s_output_names.insert(container ? v_samples[j] : sample_file_name).second ||
+						(container && container->FindMember(v_samples[j], member_id)))
 					{
-						if (i_variant < no_variants)
-						{
-							c_eof = !cfile->GetVariantGenotypesRawAndDesc(c_desc, rle_genotypes);
-							++i_variant;
-						}
-						else
-						{
-							c_desc.chrom.clear();
-							c_eof = true;
-						}
+						cerr << "Sample: " << v_samples[j] << " occurs more than once\n";
+						return false;
 					}
-				}
-				else
-				{
-					c_eof = !cfile->GetVariantGenotypesRaw(rle_genotypes);
-					++i_variant;
-				}
 
-				if (need_new_v_variant)
-				{
-					v_data.clear();
-					if (i < no_variants_in_buf)
+					v_outputs.emplace_back();
+					auto &output = v_outputs.back();
+
+					output.input_id = v_inputs.size() - 1;
+					output.column = j;
+					output.name = v_samples[j];
+					output.to_container = container != nullptr;
+					output.sfile.reset(new CSampleFile());
+					output.sfile->SetNoThreads(single_sample ? no_work_threads : 1);
+					if (!output.sfile->OpenForWriting(sample_file_name, params.extra_variants))
 					{
-						v_eof = !vfile->GetVariant(v_desc, v_data);
-						++i;
+						cerr << "Cannot open: " << sample_file_name << endl;
+						return false;
 					}
-					else
-						v_eof = true;
-				}
 
-				if (c_eof && v_eof)
-				{
-					continue;
+					output.sfile->WriteHeaderAndSample(header, params.store_sample_header ? v_header : empty_header, v_samples[j]);
+					output.tracker.reset(new CSampleTracker(cfile.get(), max_match_len));
 				}
-			
-				if (params.extra_variants)
-				{
-					if (v_desc == c_desc)
-					{
-						need_new_c_variant = true;
-						need_new_v_variant = true;
+			}
 
-						v_ev_flags_compress.push_back(0);
-					}
-					else if (v_desc < c_desc)
-					{
-						need_new_c_variant = false;
-						need_new_v_variant = true;
+			if (end_column < v_samples.size())
+				first_column = end_column;
+			else
+			{
+				++i_input;
+				first_column = 0;
+			}
+		}
 
-						v_ev_flags_compress.push_back(1);
-						v_ev_desc.push_back(make_pair(v_desc, v_data));
+		process_row_batches(*cfile, params.extra_variants, [&](vector<db_row_t> &v_rows, size_t no_rows, bool last_batch) {
+			parallel_for(v_inputs.size(), no_work_threads, [&](size_t i) {
+				match_sample_variants(v_inputs[i], v_rows, no_rows, last_batch);
+			});
 
-						continue;
-					}
-					else
-					{
-						need_new_c_variant = true;
-						need_new_v_variant = false;
+			parallel_for(v_outputs.size(), no_work_threads, [&](size_t i) {
+				compress_sample_steps(v_outputs[i], v_inputs[v_outputs[i].input_id]);
+			});
 
-						v_ev_flags_compress.push_back(2);
+			for (auto &input : v_inputs)
+				if (!input.finished)
+					return true;
 
-						continue;
-					}
-				}
+			return false;
+		}, [&](uint64_t min_id) {
+			for (auto &input : v_inputs)
+				if (!input.finished && input.row)
+					min_id = min(min_id, input.row_id);
 
-				array<uint8_t, 2> a_sample;
+			return min_id;
+		});
 
-				for (uint32_t j = 0; j < ploidy; ++j)
+		if (container)
+			for (auto &output : v_outputs)
+				if (!container->AppendMember(output.name, output.v_member, params.extra_variants ? CSampleContainer::FLAG_EXTRA_VARIANTS : 0))
 				{
-					run_t runs;
-					uint8_t value = (v_data[0] >> (2 * j)) & 0b00000011;
-					a_sample[j] = value;
-
-					cfile->EstimateValue(rle_genotypes, sample_pos_perm[j], value, runs, sample_pos_perm[j]);
+					cerr << "Cannot write: " << output.name << " to " << params.sample_file_name << endl;
+					return false;
+				}
+	}
 
-					v_sample_data_compress.push_back(make_tuple(value, runs, no_pred_same[j], no_succ_same[j]));
+	return true;
+}
 
-					if (runs[0].first == value)
-						no_pred_same[j] = min<size_t>(no_pred_same[j]+1, max_tracked_dist);
-					else
-					{
-						uint32_t pos_sample_to_trace;
+// ******************************************************************************
+// Variants of the input file are matched to rows of the database in chunks of no_variants_in_buf variants.
+// The matching stops when all rows of the batch are used and is continued for the next batch.
+void CApplication::match_sample_variants(sample_input_t &input, const vector<db_row_t> &v_rows, size_t no_rows, bool last_batch)
+{
+	size_t i_row = 0;
 
-						if (find_prev_value(rle_genotypes, sample_pos_perm[j], value, pos_sample_to_trace))
-						{
-							no_pred_same[j] = 1;
-							for (uint32_t k = 0; k < d_hist_rle_genotypes.size(); ++k)
-							{
-								if (cfile->RevertDecode(pos_sample_to_trace, d_hist_rle_genotypes[k], d_hist_tracked_samples[k][j]))
-									++no_pred_same[j];
-								else
-									break;
-							}
-						}
-						else
-							no_pred_same[j] = 0;
-					}
+	input.v_steps.clear();
+	input.v_genotypes.clear();
+	input.v_chunk_flags.clear();
 
-					if (runs[1].first == value)
-						no_succ_same[j] = min<size_t>(no_succ_same[j]+1, max_tracked_dist);
-					else
-					{
-						uint32_t pos_sample_to_trace;
+	while (!input.finished)
+	{
+		if (!input.in_chunk)
+		{
+			input.in_chunk = true;
+			input.i = 0;
+			input.need_new_c_variant = true;
+			input.need_new_v_variant = true;
+			input.no_matched_in_chunk = 0;
+			input.v_ev_flags.clear();
+		}
 
-						if (find_next_value(rle_genotypes, sample_pos_perm[j], value, pos_sample_to_trace))
-						{
-							no_succ_same[j] = 1;
-							for (uint32_t k = 0; k < d_hist_rle_genotypes.size(); ++k)
-							{
-								if (cfile->RevertDecode(pos_sample_to_trace, d_hist_rle_genotypes[k], d_hist_tracked_samples[k][j]))
-									++no_succ_same[j];
-								else
-									break;
-							}
-						}
-						else
-							no_succ_same[j] = 0;
-					}
-				}
+		if (input.i >= no_variants_in_buf || (input.v_eof && input.c_eof))
+		{
+			// Processing ends at the first chunk without variants to compress (its flags are dropped)
+			if (input.no_matched_in_chunk)
+			{
+				input.v_steps.push_back(sample_step_t{ sample_step_t::kind_t::end_of_chunk, nullptr, 0, nullptr, input.v_chunk_flags.size() });
+				input.v_chunk_flags.push_back(input.v_ev_flags);
+			}
+			else
+			{
+				input.v_steps.push_back(sample_step_t{ sample_step_t::kind_t::end_of_sample, nullptr, 0, nullptr, 0 });
+				input.finished = true;
+			}
 
-				d_hist_rle_genotypes.push_front(rle_genotypes);
-				d_hist_tracked_samples.push_front(a_sample);
+			input.in_chunk = false;
+			continue;
+		}
 
-				if (d_hist_tracked_samples.size() > max_tracked_dist)
-				{
-					d_hist_rle_genotypes.pop_back();
-					d_hist_tracked_samples.pop_back();
-				}
+		if (!params.extra_variants || input.need_new_c_variant)
+		{
+			if (i_row < no_rows)
+			{
+				input.row = v_rows[i_row].row;
+				input.row_id = v_rows[i_row].id;
+				input.div = v_rows[i_row].div;
+				if (params.extra_variants)
+					input.c_desc = v_rows[i_row].desc;
+				input.c_eof = false;
+				++i_row;
 			}
+			else if (!last_batch)
+				return;
+			else
+			{
+				input.c_desc.chrom.clear();
+				input.c_eof = true;
+			}
+		}
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+		if (input.need_new_v_variant)
+		{
+			input.v_data.clear();
+			input.v_eof = !input.vfile->GetVariant(input.v_desc, input.v_data);
+			++input.i;
 		}
-	}));
 
-	// Thread writing decompressed sample VCF file in parts
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
+		if (input.c_eof && input.v_eof)
+			continue;
+
+		if (params.extra_variants)
 		{
-			if (!v_sample_data_io.empty())
+			if (input.v_desc == input.c_desc)
 			{
-				if (params.extra_variants)
-				{
-					for (size_t i = 0; i < v_ev_flags_io.size(); ++i)
-						sfile->PutFlag(v_ev_flags_io[i]);
+				input.need_new_c_variant = true;
+				input.need_new_v_variant = true;
 
-					sfile->PutFlag(3);		// end of flags
-				}
+				input.v_ev_flags.push_back(0);
+			}
+			else if (input.v_desc < input.c_desc)
+			{
+				input.need_new_c_variant = false;
+				input.need_new_v_variant = true;
+
+				input.v_ev_flags.push_back(1);
+				input.v_ev_desc.push_back(make_pair(input.v_desc, input.v_data));
 
-				v_ev_flags_io.clear();
+				continue;
 			}
+			else
+			{
+				input.need_new_c_variant = true;
+				input.need_new_v_variant = false;
 
-			for (size_t i = 0; i < v_sample_data_io.size(); ++i)
-				sfile->Put(get<0>(v_sample_data_io[i]), get<1>(v_sample_data_io[i]), get<2>(v_sample_data_io[i]), get<3>(v_sample_data_io[i]));
-			v_sample_data_io.clear();
+				input.v_ev_flags.push_back(2);
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+				continue;
+			}
 		}
 
-		sfile->PutFlag(4);		// EOF
-	}));
+		// Genotypes of missing variants (database longer than the sample file without -ev) are taken as 0
+		input.v_data.resize(input.no_samples, 0);
 
-	// Synchronization
-	while (!end_of_processing)
+		input.v_steps.push_back(sample_step_t{ sample_step_t::kind_t::variant, input.row, input.row_id, input.div, input.v_genotypes.size() });
+		input.v_genotypes.insert(input.v_genotypes.end(), input.v_data.begin(), input.v_data.end());
+		++input.no_matched_in_chunk;
+	}
+}
+
+// ******************************************************************************
+// Steps of the input file are made for a single sample; genotypes are stored after the flags of their chunk
+void CApplication::compress_sample_steps(sample_output_t &output, sample_input_t &input)
+{
+	for (auto &step : input.v_steps)
 	{
-		barrier.count_down_and_wait();
-		swap(v_sample_data_compress, v_sample_data_io);
-		swap(v_ev_flags_compress, v_ev_flags_io);
+		if (step.kind == sample_step_t::kind_t::variant)
+		{
+			uint8_t genotype = input.v_genotypes[step.idx + output.column];
 
-		if (v_sample_data_io.empty())
-			end_of_processing = true;
+			for (uint32_t j = 0; j < output.tracker->GetPloidy(); ++j)
+			{
+				run_t runs;
+				uint8_t value = (genotype >> (2 * j)) & 0b00000011;
+				uint32_t no_pred_same = output.tracker->NoPredSame(j);
+				uint32_t no_succ_same = output.tracker->NoSuccSame(j);
 
-		cout << i_variant << "\r";
-		fflush(stdout);
-		barrier.count_down_and_wait();
-	}
+				output.tracker->Update(*step.row, step.div.get(), step.row_id, j, value, runs);
+				output.v_sample_data.push_back(make_tuple(value, runs, no_pred_same, no_succ_same));
+			}
+		}
+		else if (step.kind == sample_step_t::kind_t::end_of_chunk)
+		{
+			if (params.extra_variants)
+			{
+				for (auto flag : input.v_chunk_flags[step.idx])
+					output.sfile->PutFlag(flag);
 
-	// If necessary we need to encode extra variant descriptions
-	if (params.extra_variants)
-		sfile->WriteExtraVariants(v_ev_desc);
+				output.sfile->PutFlag(3);		// end of flags
+			}
 
-	t_vcf->join();
-	t_io->join();
+			for (auto &x : output.v_sample_data)
+				output.sfile->Put(get<0>(x), get<1>(x), get<2>(x), get<3>(x));
+			output.v_sample_data.clear();
+		}
+		else
+		{
+			output.sfile->PutFlag(4);		// EOF
 
-	return true;
+			// If necessary we need to encode extra variant descriptions (with genotypes of the sample only)
+			if (params.extra_variants)
+			{
+				vcf_part_t v_ev_desc;
+
+				v_ev_desc.reserve(input.v_ev_desc.size());
+				for (auto &x : input.v_ev_desc)
+					v_ev_desc.push_back(make_pair(x.first, vector<uint8_t>(1, x.second[output.column])));
+
+				output.sfile->WriteExtraVariants(v_ev_desc);
+			}
+
+			if (output.to_container)
+			{
+				output.sfile->Close();
+				output.sfile->GetData(output.v_member);
+			}
+
+			output.sfile.reset();
+			output.tracker.reset();
+		}
+	}
 }
 
 // ******************************************************************************
 bool CApplication::DecompressSample()
 {
-	CBarrier barrier(3);
-	unique_ptr<CSampleFile> sfile(new CSampleFile());
-	unique_ptr<CCompressedFile> cfile(new CCompressedFile());
-	unique_ptr<CVCF> vfile(new CVCF());
-	bool end_of_processing = false;
-	vector<pair<uint8_t, uint32_t>> rle_genotypes;
-	bool extra_variants;
-
-	if (!cfile->OpenForReading(params.db_file_name))
-		return false;
+	return decompress_samples(vector<string>{ params.sample_file_name }, [&](const string &) {
+		return params.vcf_file_name;
+	});
+}
 
-	uint32_t ploidy = cfile->GetPloidy();
+// ******************************************************************************
+bool CApplication::DecompressSamples()
+{
+	vector<string> v_sample_file_names;
+	CSampleContainer container;
 
-	if (!sfile->OpenForReading(params.sample_file_name, extra_variants))
+	if (params.sample_container && !container.OpenForReading(params.sample_file_name))
 	{
 		cerr << "Cannot open: " << params.sample_file_name << endl;
 		return false;
 	}
 
-	if (!vfile->OpenForWriting(params.vcf_file_name, params.out_type, params.bcf_compression_level))
+	// For a container the list is optional and contains names of its samples
+	if (!params.sample_list_file_name.empty())
 	{
-		cerr << "Cannot open: " << params.vcf_file_name << endl;
-		return false;
+		ifstream ifs(params.sample_list_file_name);
+		string name;
+
+		if (!ifs.is_open())
+		{
+			cerr << "Cannot open: " << params.sample_list_file_name << endl;
+			return false;
+		}
+
+		while (getline(ifs, name))
+		{
+			name = trim(name);
+			if (!name.empty())
+				v_sample_file_names.push_back(name);
+		}
 	}
+	else
+		for (size_t i = 0; i < container.NoMembers(); ++i)
+			v_sample_file_names.push_back(container.Member(i).name);
 
-	cfile->InitPBWT();
-	params.neglect_limit = cfile->GetNeglectLimit();
+	if (v_sample_file_names.empty())
+	{
+		cerr << "No samples to decompress\n";
+		return false;
+	}
 
-	uint32_t no_variants = cfile->GetNoVariants();
-	uint32_t i_variant = 0;
+	string ext = params.out_type == file_type::BCF ? ".bcf" : ".vcf";
 
-	string header;
-	vector<string> v_samples;
-	string sample_name;
-	string v_header;
+	return decompress_samples(v_sample_file_names, [&](const string &sample_name) {
+		return params.vcf_file_name + "/" + sample_name + ext;
+	}, params.sample_container ? &container : nullptr);
+}
 
-	cfile->GetHeader(header);
-	cfile->GetSamples(v_samples);
+// ******************************************************************************
+// Samples are decompressed in passes over the database (of at most max_samples_in_pass samples, unless they are merged into a single file).
+// Each row is decoded once in a pass and shared by trackers of all samples.
+// Samples are given by names of files or (if the container is given) by names of its members.
+bool CApplication::decompress_samples(const vector<string> &v_sample_file_names, const function<string(const string&)> &output_name,
+	CSampleContainer *container)
+{
+	unordered_set<string> s_output_names;
+	size_t pass_size = params.merge_samples ? v_sample_file_names.size() : max_samples_in_pass;
+	unique_ptr<CVCF> vfile_merged;
 
-	sfile->ReadHeaderAndSample(header, v_header, sample_name);
+	for (size_t pass_start = 0; pass_start < v_sample_file_names.size(); pass_start += pass_size)
+	{
+		unique_ptr<CCompressedFile> cfile(new CCompressedFile());
 
-	vfile->SetHeader(v_header);
-	params.id_sample = sample_name;
-	vfile->AddSample(params.id_sample);
-	vfile->WriteHeader();
+		cfile->SetNoThreads(no_work_threads);
+		if (!cfile->OpenForReading(params.db_file_name))
+			return false;
 
-	array<uint32_t, 2> sample_pos;
-	array<uint32_t, 2> sample_pos_perm;
-	uint32_t no_pred_same[2] = { 0, 0 };
-	uint32_t no_succ_same[2] = { 0, 0 };
+		cfile->InitPBWT();
+		params.neglect_limit = cfile->GetNeglectLimit();
 
-	vector<uint8_t> v_ev_flags_compress, v_ev_flags_io;
-	vector<pair<variant_desc_t, vector<uint8_t>>> v_ev_desc;
+		uint32_t ploidy = cfile->GetPloidy();
+		string header;
+		vector<string> v_sample_names;
 
-	sfile->ReadExtraVariants(v_ev_desc);
-	int ev_pos = 0;
+		cfile->GetHeader(header);
 
-	if (ploidy == 1)
-		sample_pos[0] = (uint32_t)v_samples.size();
-	else if (ploidy == 2)
-	{
-		sample_pos[0] = 2u * (uint32_t)v_samples.size();
-		sample_pos[1] = sample_pos[0];
-	}
-	sample_pos_perm = sample_pos;
+		vector<sample_decoder_t> v_decoders(min(pass_size, v_sample_file_names.size() - pass_start));
+		vector<char> v_opened(v_decoders.size());
 
-	vfile->SetPloidy(ploidy);
+		// Samples are loaded (and their extra variants decompressed) in parallel
+		parallel_for(v_decoders.size(), no_work_threads, [&](size_t i) {
+			auto &dec = v_decoders[i];
+			const string &name = v_sample_file_names[pass_start + i];
+			size_t member_id;
 
-	// Thread making rev-PBWT and estimating position of the sample to process
-	unique_ptr<thread> t_vcf(new thread([&] {
-		variant_desc_t desc;
-		array<uint8_t, 2> a_sample;
+			dec.sfile.reset(new CSampleFile());
+			dec.sfile->SetNoThreads(v_sample_file_names.size() == 1 ? no_work_threads : 1);
 
-		bool c_eof = false;
-		uint32_t f_pos = 0;
+			if (!container)
+				v_opened[i] = dec.sfile->OpenForReading(name, dec.extra_variants);
+			else if (container->FindMember(name, member_id))
+				v_opened[i] = dec.sfile->OpenForReading(container->MemberData(member_id), container->Member(member_id).size, dec.extra_variants);
+			else
+				v_opened[i] = false;
+		});
 
-		while (!end_of_processing)
+		for (size_t i = 0; i < v_decoders.size(); ++i)
 		{
-			barrier.count_down_and_wait();
+			auto &dec = v_decoders[i];
+			string v_header;
+			string sample_name;
 
-			bool need_new_c_variant = true;
-			bool need_new_v_variant = true;
-			bool v_eof = false;
+			if (!v_opened[i])
+			{
+				cerr << "Cannot open: " << v_sample_file_names[pass_start + i] << endl;
+				return false;
+			}
 
-			v_ev_flags_io.clear();
+			dec.sfile->ReadHeaderAndSample(header, v_header, sample_name);
+			dec.sfile->ReadExtraVariants(dec.v_ev_desc);
+			dec.tracker.reset(new CSampleTracker(cfile.get(), max_match_len));
 
-			if (extra_variants)
+			if (params.merge_samples)
 			{
-				uint8_t ev_flag;
-				while (true)
+				if (dec.extra_variants)
 				{
-					sfile->GetFlag(ev_flag);
-					if (ev_flag >= 3)
-						break;
-					v_ev_flags_io.push_back(ev_flag);
+					cerr << "Sample: " << sample_name << " is compressed with extra variants, so it cannot be merged\n";
+					return false;
 				}
-				f_pos = 0;
-
-				if (ev_flag == 4)
+				if (!s_output_names.insert(sample_name).second)
 				{
-					end_of_processing = true;
-					barrier.count_down_and_wait();
-					barrier.count_down_and_wait();
-					continue;
+					cerr << "Sample: " << sample_name << " occurs more than once\n";
+					return false;
 				}
+				v_sample_names.push_back(sample_name);
 
-				if (v_ev_flags_io.empty())
-				{
-					barrier.count_down_and_wait();
-					barrier.count_down_and_wait();
-					continue;
-				}
+				continue;
 			}
 
-			v_sample_d_data_compress.clear();
+			string vcf_file_name = output_name(sample_name);
 
-			for (size_t i = 0; i < no_variants_in_buf && (!c_eof || !v_eof);)
+			if (!s_output_names.insert(vcf_file_name).second)
 			{
-				if (!extra_variants)
-				{
-					need_new_c_variant = true;
-					need_new_v_variant = true;
+				cerr << "Sample: " << sample_name << " occurs more than once\n";
+				return false;
+			}
 
-					c_eof = v_eof = i_variant >= no_variants;
-				}
-				else
+			dec.vfile.reset(new CVCF());
+			if (!dec.vfile->OpenForWriting(vcf_file_name, params.out_type, params.bcf_compression_level))
+			{
+				cerr << "Cannot open: " << vcf_file_name << endl;
+				return false;
+			}
+
+			dec.vfile->SetHeader(v_header);
+			dec.vfile->AddSample(sample_name);
+			dec.vfile->WriteHeader();
+			dec.vfile->SetPloidy(ploidy);
+		}
+
+		if (params.merge_samples)
+		{
+			vfile_merged.reset(new CVCF());
+			if (!vfile_merged->OpenForWriting(params.vcf_file_name, params.out_type, params.bcf_compression_level))
+			{
+				cerr << "Cannot open: " << params.vcf_file_name << endl;
+				return false;
+			}
+
+			vfile_merged->SetHeader(header);
+			vfile_merged->AddSamples(v_sample_names);
+			vfile_merged->WriteHeader();
+			vfile_merged->SetPloidy(ploidy);
+		}
+
+		process_row_batches(*cfile, true, [&](vector<db_row_t> &v_rows, size_t no_rows, bool last_batch) {
+			parallel_for(v_decoders.size(), no_work_threads, [&](size_t i) {
+				decode_sample_variants(v_decoders[i], v_rows, no_rows, last_batch);
+			});
+
+			// Without extra variants there is a single genotype of each sample for each row
+			if (vfile_merged)
+			{
+				vector<uint8_t> data(v_decoders.size());
+				uint8_t missing = ploidy == 2 ? 0b00011111 : 0b11;
+
+				for (size_t i = 0; i < no_rows; ++i)
 				{
-					if (v_ev_flags_io[f_pos] == 0)
-					{
-						need_new_c_variant = true;
-						need_new_v_variant = true;
-					}
-					else if (v_ev_flags_io[f_pos] == 1)
-					{
-						need_new_c_variant = false;
-						need_new_v_variant = true;
-					}
-					else if (v_ev_flags_io[f_pos] == 2)
-					{
-						need_new_c_variant = true;
-						need_new_v_variant = false;
-					}
-					else
-					{
-						v_eof = true;
-						need_new_c_variant = false;
-						need_new_v_variant = false;
-					}
-					++f_pos;
+					for (size_t j = 0; j < v_decoders.size(); ++j)
+						data[j] = i < v_decoders[j].v_values.size() ? v_decoders[j].v_values[i] : missing;
 
-					if (f_pos == v_ev_flags_io.size())
-						v_eof = true;
+					vfile_merged->SetVariant(v_rows[i].desc, data);
 				}
+			}
+
+			for (auto &dec : v_decoders)
+				if (!dec.finished)
+					return true;
+
+			return false;
+		}, [&](uint64_t min_id) {
+			return min_id;
+		});
+	}
 
-				if (need_new_c_variant)
+	if (vfile_merged)
+		vfile_merged->Close();
+	cout << endl;
+
+	return true;
+}
+
+// ******************************************************************************
+// Genotypes of the sample are decoded in chunks (as they were compressed) and extra variants are put between variants of the database.
+// The decoding stops when all rows of the batch are used and is continued for the next batch.
+void CApplication::decode_sample_variants(sample_decoder_t &dec, vector<db_row_t> &v_rows, size_t no_rows, bool last_batch)
+{
+	size_t i_row = 0;
+
+	dec.v_values.clear();
+
+	while (!dec.finished)
+	{
+		if (!dec.in_chunk)
+		{
+			if (dec.extra_variants)
+			{
+				uint8_t ev_flag;
+
+				dec.v_ev_flags.clear();
+				while (true)
 				{
-					c_eof = !cfile->GetVariantGenotypesRawAndDesc(desc, rle_genotypes);
-					++i_variant;
+					dec.sfile->GetFlag(ev_flag);
+					if (ev_flag >= 3)
+						break;
+					dec.v_ev_flags.push_back(ev_flag);
 				}
+				dec.f_pos = 0;
 
-				if (!need_new_c_variant && need_new_v_variant)
+				if (ev_flag == 4 || dec.v_ev_flags.empty())
 				{
-					v_sample_d_data_compress.push_back(make_pair(v_ev_desc[ev_pos].first, v_ev_desc[ev_pos].second[0]));
-					++ev_pos;
-					++i;
+					finish_sample_decoding(dec);
 					continue;
 				}
+			}
 
-				if (v_eof && c_eof)
-					continue;
-
-				if (!need_new_v_variant)
-					continue;
-				++i;
+			dec.in_chunk = true;
+			dec.i = 0;
+			dec.v_eof = false;
+			dec.no_decoded_in_chunk = 0;
+		}
 
-				uint8_t value = ploidy == 2 ? 0b00010000 : 0;		// Data phased
+		// Chunk ends also when all its flags are used
+		if (dec.i >= no_variants_in_buf || (dec.c_eof && dec.v_eof) || (dec.extra_variants && dec.f_pos == dec.v_ev_flags.size()))
+		{
+			dec.in_chunk = false;
 
-				for (uint32_t j = 0; j < ploidy; ++j)
-				{
-					run_t runs;
-					uint32_t tmp;
-					uint8_t v;
+			// Processing ends at the first empty chunk
+			if (!dec.no_decoded_in_chunk)
+				finish_sample_decoding(dec);
+			continue;
+		}
 
-					cfile->EstimateValue(rle_genotypes, sample_pos_perm[j], 0, runs, tmp);
-					sfile->Get(v, runs, no_pred_same[j], no_succ_same[j]);
-					cfile->EstimateValue(rle_genotypes, sample_pos_perm[j], v, runs, sample_pos_perm[j]);
+		bool need_new_c_variant = true;
+		bool need_new_v_variant = true;
 
-					if (runs[0].first == v)
-						no_pred_same[j] = min<size_t>(no_pred_same[j] + 1, max_tracked_dist);
-					else
-					{
-						uint32_t pos_sample_to_trace;
+		if (dec.extra_variants)
+		{
+			need_new_c_variant = dec.v_ev_flags[dec.f_pos] != 1;
+			need_new_v_variant = dec.v_ev_flags[dec.f_pos] != 2;
+		}
 
-						if (find_prev_value(rle_genotypes, sample_pos_perm[j], v, pos_sample_to_trace))
-						{
-							no_pred_same[j] = 1;
-							for (uint32_t k = 0; k < d_hist_rle_genotypes.size(); ++k)
-							{
-								if (cfile->RevertDecode(pos_sample_to_trace, d_hist_rle_genotypes[k], d_hist_tracked_samples[k][j]))
-									++no_pred_same[j];
-								else
-									break;
-							}
-						}
-						else
-							no_pred_same[j] = 0;
-					}
+		if (need_new_c_variant && i_row == no_rows && !last_batch)
+			return;
 
-					if (runs[1].first == v)
-						no_succ_same[j] = min<size_t>(no_succ_same[j] + 1, max_tracked_dist);
-					else
-					{
-						uint32_t pos_sample_to_trace;
+		if (dec.extra_variants && ++dec.f_pos == dec.v_ev_flags.size())
+			dec.v_eof = true;
 
-						if (find_next_value(rle_genotypes, sample_pos_perm[j], v, pos_sample_to_trace))
-						{
-							no_succ_same[j] = 1;
-							for (uint32_t k = 0; k < d_hist_rle_genotypes.size(); ++k)
-							{
-								if (cfile->RevertDecode(pos_sample_to_trace, d_hist_rle_genotypes[k], d_hist_tracked_samples[k][j]))
-									++no_succ_same[j];
-								else
-									break;
-							}
-						}
-						else
-							no_succ_same[j] = 0;
-					}
+		db_row_t *c_row = nullptr;
 
-					value += v << (2 * j);
-					a_sample[j] = v;
-				}
-				v_sample_d_data_compress.push_back(make_pair(desc, value));
+		if (need_new_c_variant)
+		{
+			if (i_row < no_rows)
+				c_row = &v_rows[i_row++];
 
-				d_hist_rle_genotypes.push_front(rle_genotypes);
-				d_hist_tracked_samples.push_front(a_sample);
+			dec.c_eof = c_row == nullptr;
+			if (!dec.extra_variants)
+				dec.v_eof = dec.c_eof;
+		}
 
-				if (d_hist_tracked_samples.size() > max_tracked_dist)
-				{
-					d_hist_rle_genotypes.pop_back();
-					d_hist_tracked_samples.pop_back();
-				}
-			}
+		if (!need_new_c_variant && need_new_v_variant)
+		{
+			auto &ev = dec.v_ev_desc[dec.ev_pos++];
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+			put_sample_variant(dec, ev.first, ev.second[0]);
+			++dec.i;
+			continue;
 		}
-	}));
 
-	// Thread writing compressed sample file file in parts
-	unique_ptr<thread> t_io(new thread([&] {
-		while (!end_of_processing)
-		{
-			barrier.count_down_and_wait();
-			vector<uint8_t> variants(1);
+		if (dec.c_eof || !need_new_v_variant)
+			continue;
+		++dec.i;
 
-			for (size_t i = 0; i < v_sample_d_data_io.size(); ++i)
-			{
-				variants[0] = v_sample_d_data_io[i].second;
-				vfile->SetVariant(v_sample_d_data_io[i].first, variants);
-			}
+		uint8_t value = dec.tracker->GetPloidy() == 2 ? 0b00010000 : 0;		// Data phased
 
-			v_sample_d_data_io.clear();
+		for (uint32_t j = 0; j < dec.tracker->GetPloidy(); ++j)
+		{
+			run_t runs;
+			uint8_t v;
+
+			dec.tracker->GetRuns(*c_row->row, j, runs);
+			dec.sfile->Get(v, runs, dec.tracker->NoPredSame(j), dec.tracker->NoSuccSame(j));
+			dec.tracker->Update(*c_row->row, c_row->div.get(), c_row->id, j, v, runs);
 
-			barrier.count_down_and_wait();
-			barrier.count_down_and_wait();
+			value += v << (2 * j);
 		}
-	}));
 
-	// Synchronization
-	while (!end_of_processing)
-	{
-		barrier.count_down_and_wait();
-		barrier.count_down_and_wait();
-		swap(v_sample_d_data_compress, v_sample_d_data_io);
-		if (v_sample_d_data_io.empty())
-			end_of_processing = true;
+		put_sample_variant(dec, c_row->desc, value);
+	}
+}
 
-		cout << i_variant << "\r";
-		fflush(stdout);
-		barrier.count_down_and_wait();
+// ******************************************************************************
+void CApplication::put_sample_variant(sample_decoder_t &dec, variant_desc_t &desc, uint8_t value)
+{
+	if (dec.vfile)
+	{
+		vector<uint8_t> variants(1, value);
+		dec.vfile->SetVariant(desc, variants);
 	}
+	else
+		dec.v_values.push_back(value);
 
-	cout << i_variant << "\r";
-	fflush(stdout);
+	++dec.no_decoded_in_chunk;
+}
 
-	t_vcf->join();
-	t_io->join();
+// ******************************************************************************
+void CApplication::finish_sample_decoding(sample_decoder_t &dec)
+{
+	dec.finished = true;
 
-	vfile->Close();
-	cout << endl;
+	if (dec.vfile)
+		dec.vfile->Close();
 
-	return true;
+	dec.sfile.reset();
+	dec.tracker.reset();
 }
 
 // EOF
@@ -15,11 +15,15 @@
 #include <list>
 #include <deque>
 #include <memory>
+#include <functional>
 
 #include "params.h"
 #include "vcf.h"
 #include "cfile.h"
 #include "sfile.h"
+#include "utils.h"
+#include "sample_tracker.h"
+#include "sample_container.h"
 
 using namespace std;
 
@@ -27,28 +31,137 @@ using namespace std;
 class CApplication
 {
 	const size_t no_variants_in_buf = 8192u;
+	const size_t no_vcf_parts_in_progress = 3;
 	typedef pair<uint8_t, uint32_t> run_desc_t;
+	typedef vector<pair<variant_desc_t, vector<uint8_t>>> vcf_part_t;
 
-	list<vector<run_desc_t>> l_hist_rle_genotypes;
-	list<array<uint8_t, 2>> l_hist_tracked_samples;
+	const uint32_t max_match_len = 2048;
+	const size_t no_rows_in_batch = 256;
+	const size_t max_divergence_size_in_batch = 32u << 20;		// batches are shorter if divergence arrays of their rows are larger
+	const size_t no_row_batches_in_progress = 3;
+	const size_t max_samples_in_pass = 256;
 
-	const size_t max_tracked_dist = 2048;
+	// Row of the database shared by trackers of all samples compressed in a pass
+	typedef struct {
+		const CRLERow *row;
+		uint64_t id;
+		shared_ptr<const CDivergenceArray> div;		// only if the row permutes haplotypes
+		variant_desc_t desc;		// only if extra variants are allowed
+	} db_row_t;
 
-	deque<vector<run_desc_t>> d_hist_rle_genotypes;
-	deque<array<uint8_t, 2>> d_hist_tracked_samples;
+	// Batch of rows decoded ahead of processing
+	typedef struct {
+		vector<db_row_t> v_rows;
+		size_t no_rows;
+		uint64_t next_id;			// id of the first row of the next batch
+		bool last;
+	} row_batch_t;
 
-	CParams params;
+	// Step of compression of samples of an input file
+	typedef struct {
+		enum class kind_t {variant, end_of_chunk, end_of_sample} kind;
+		const CRLERow *row;
+		uint64_t row_id;
+		shared_ptr<const CDivergenceArray> div;
+		size_t idx;					// index of genotypes (variant) or flags (end_of_chunk)
+	} sample_step_t;
+
+	// Input file of compress-sample(s) with the state of matching its variants to rows of the database
+	typedef struct {
+		unique_ptr<CVCF> vfile;
+		uint32_t no_samples;
+		bool finished;
+		bool in_chunk;
+		size_t i;					// no. of variants read in the current chunk
+		bool need_new_c_variant;
+		bool need_new_v_variant;
+		bool v_eof;
+		bool c_eof;
+		variant_desc_t v_desc;
+		variant_desc_t c_desc;
+		vector<uint8_t> v_data;
+		const CRLERow *row;
+		uint64_t row_id;
+		shared_ptr<const CDivergenceArray> div;
+		size_t no_matched_in_chunk;
+		vector<uint8_t> v_ev_flags;
+		vcf_part_t v_ev_desc;
+
+		// Steps made in the current batch of rows; they are common for all samples of the file
+		vector<sample_step_t> v_steps;
+		vector<uint8_t> v_genotypes;
+		vector<vector<uint8_t>> v_chunk_flags;
+	} sample_input_t;
 
-	vector<pair<variant_desc_t, vector<uint8_t>>> v_vcf_data_compress, v_vcf_data_io;
+	// Compressed sample
+	typedef struct {
+		size_t input_id;
+		uint32_t column;
+		string name;
+		unique_ptr<CSampleFile> sfile;
+		unique_ptr<CSampleTracker> tracker;
+		vector<tuple<uint8_t, run_t, uint32_t, uint32_t>> v_sample_data;
+		bool to_container;
+		vector<uint8_t> v_member;			// contents of the compressed sample (if it is stored in a container)
+	} sample_output_t;
 
-	vector<tuple<uint8_t, run_t, uint32_t, uint32_t>> v_sample_data_compress, v_sample_data_io;
-	vector<pair<variant_desc_t, uint8_t>> v_sample_d_data_compress, v_sample_d_data_io;
+	// Decompressed sample with the state of decoding its chunks
+	typedef struct {
+		unique_ptr<CSampleFile> sfile;
+		unique_ptr<CSampleTracker> tracker;
+		unique_ptr<CVCF> vfile;				// output of the sample (none if samples are merged)
+		bool extra_variants;
+		vcf_part_t v_ev_desc;
+		size_t ev_pos;
+		vector<uint8_t> v_ev_flags;
+		size_t f_pos;
+		bool finished;
+		bool in_chunk;
+		size_t i;							// no. of variants decoded in the current chunk
+		size_t no_decoded_in_chunk;
+		bool v_eof;
+		bool c_eof;
+		vector<uint8_t> v_values;			// genotypes of rows of the current batch (if samples are merged)
+	} sample_decoder_t;
+
+	CParams params;
+	uint32_t no_hts_threads;
+	uint32_t no_work_threads;
 
 	mutex mtx;
 	condition_variable cv;
 
-	bool find_prev_value(const vector<run_desc_t> &v_rle_genotypes, const uint32_t max_pos, const uint8_t value, uint32_t &found_pos);
-	bool find_next_value(const vector<run_desc_t> &v_rle_genotypes, const uint32_t min_pos, const uint8_t value, uint32_t &found_pos);
+	// Ranges of blocks to decode (whole archive or blocks overlapping regions)
+	vector<pair<uint32_t, uint32_t>> v_block_ranges;
+	size_t i_block_range;
+	uint32_t block_range_end;
+
+	// No. of threads left for a job when no_busy other threads are running
+	uint32_t no_threads_besides(uint32_t no_busy) const
+	{
+		return no_work_threads > no_busy ? no_work_threads - no_busy : 1;
+	}
+
+	bool init_block_ranges(CCompressedFile &cfile);
+	bool in_regions(const variant_desc_view_t &desc);
+	bool decode_blocks(const function<bool(uint32_t, CBlockReader&)> &start_block,
+		const function<bool(CBlockReader&, variant_desc_view_t&, vector<uint8_t>&)> &read_variant,
+		const function<void(variant_desc_view_t&, vector<uint8_t>&)> &write_variant);
+
+	bool extract_samples(vector<string> &v_ids);
+
+	void process_row_batches(CCompressedFile &cfile, bool with_desc,
+		const function<bool(vector<db_row_t>&, size_t, bool)> &process_batch,
+		const function<uint64_t(uint64_t)> &oldest_row_id);
+	bool compress_samples(const vector<string> &v_input_names, const function<string(const string&)> &output_name, bool single_sample,
+		CSampleContainer *container = nullptr);
+	void match_sample_variants(sample_input_t &input, const vector<db_row_t> &v_rows, size_t no_rows, bool last_batch);
+	void compress_sample_steps(sample_output_t &output, sample_input_t &input);
+	bool decompress_samples(const vector<string> &v_sample_file_names, const function<string(const string&)> &output_name,
+		CSampleContainer *container = nullptr);
+	void decode_sample_variants(sample_decoder_t &dec, vector<db_row_t> &v_rows, size_t no_rows, bool last_batch);
+	void put_sample_variant(sample_decoder_t &dec, variant_desc_t &desc, uint8_t value);
+	void finish_sample_decoding(sample_decoder_t &dec);
 
 public:
 	CApplication(const CParams &_params);
@@ -57,8 +170,12 @@ public:
 	bool CompressDB();
 	bool DecompressDB();
 	bool CompressSample();
+	bool CompressSamples();
 	bool DecompressSample();
+	bool DecompressSamples();
 	bool ExtractSample();
+	bool ExtractSamples();
+	bool Stats();
 };
 
 // EOF
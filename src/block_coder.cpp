@@ -0,0 +1,256 @@
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include "block_coder.h"
+#include "utils.h"
+
+// ************************************************************************************
+CBlockCoder::CBlockCoder()
+{
+	vios = new CVectorIOStream(v_data);
+	mis = new CMemoryInStream();
+	rce = new CRangeEncoder<CVectorIOStream>(*vios);
+	rcd = new CRangeDecoder<CMemoryInStream>(*mis);
+}
+
+// ************************************************************************************
+CBlockCoder::~CBlockCoder()
+{
+	rce_coders.clear();
+	rcd_coders.clear();
+
+	delete rce;
+	delete rcd;
+	delete vios;
+	delete mis;
+}
+
+// ************************************************************************************
+void CBlockCoder::StartEncoding()
+{
+	v_data.clear();
+	rce_coders.clear();
+	rce->Start();
+}
+
+// ************************************************************************************
+// The last run is stored with zero length as it is implied by the no. of items
+void CBlockCoder::EncodeRow(const vector<pair<uint8_t, uint32_t>> &v_rle)
+{
+	ctx_prefix = context_prefix_mask;
+	ctx_symbol = context_symbol_mask;
+
+	for (size_t i = 0; i + 1 < v_rle.size(); ++i)
+		encode_run_len(v_rle[i].first, v_rle[i].second);
+	encode_run_len(v_rle.back().first, 0u);
+}
+
+// ************************************************************************************
+// Finish the stream and move it to v_stream
+void CBlockCoder::EndEncoding(vector<uint8_t> &v_stream)
+{
+	rce->End();
+
+	v_stream.clear();
+	swap(v_stream, v_data);
+}
+
+// ************************************************************************************
+// Decode the stream directly from the memory (e.g., memory mapped file); it must be valid until the end of decoding
+void CBlockCoder::StartDecoding(const uint8_t *stream, size_t size)
+{
+	mis->Attach(stream, size);
+	rcd_coders.clear();
+	rcd->Start();
+}
+
+// ************************************************************************************
+// Returns false if the row is corrupted (runs longer than no_items or the stream is too short)
+bool CBlockCoder::DecodeRow(uint32_t no_items, vector<pair<uint8_t, uint32_t>> &v_rle)
+{
+	uint32_t total_len = 0;
+	ctx_prefix = context_prefix_mask;
+	ctx_symbol = context_symbol_mask;
+
+	v_rle.clear();
+
+	while (total_len < no_items)
+	{
+		uint8_t symbol;
+		uint32_t len;
+
+		decode_run_len(symbol, len);
+		if (len == 0)
+			len = no_items - total_len;
+		else if (len > no_items - total_len)
+			return false;
+
+		v_rle.push_back(make_pair(symbol, len));
+
+		total_len += len;
+	}
+
+	return !mis->Overrun();
+}
+
+// ************************************************************************************
+CBlockCoder::ctx_map_e_t::value_type CBlockCoder::find_rce_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter)
+{
+	auto p = rce_coders.find(ctx);
+
+	if (p == nullptr)
+		rce_coders.insert(ctx, p = new CRangeCoderModel<CVectorIOStream>(rce, no_symbols, max_log_counter, 1 << max_log_counter, nullptr, 1, true));
+
+	return p;
+}
+
+// ************************************************************************************
+CBlockCoder::ctx_map_d_t::value_type CBlockCoder::find_rcd_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter)
+{
+	auto p = rcd_coders.find(ctx);
+
+	if (p == nullptr)
+		rcd_coders.insert(ctx, p = new CRangeCoderModel<CMemoryInStream>(rcd, no_symbols, max_log_counter, 1 << max_log_counter, nullptr, 1, false));
+
+	return p;
+}
+
+// ************************************************************************************
+void CBlockCoder::encode_run_len(uint8_t symbol, uint32_t len)
+{
+	// Encode symbol
+	auto rc_sym = find_rce_coder(ctx_symbol + context_symbol_flag, 4, 15);
+	rc_sym->Encode(symbol);
+	ctx_symbol <<= 4;
+	ctx_symbol += symbol;
+	ctx_symbol &= context_symbol_mask;
+
+	rce_coders.prefetch(ctx_symbol + context_symbol_flag);
+
+	ctx_prefix <<= 4;
+	ctx_prefix += (context_t)symbol;
+	ctx_prefix &= context_prefix_mask;
+
+	// Encode run length
+	auto rc_p = find_rce_coder(ctx_prefix + context_prefix_flag, 11, 10);
+
+	uint32_t prefix = ilog2(len);
+
+	ctx_prefix <<= 4;
+	ctx_prefix += (context_t)prefix;
+	ctx_prefix &= context_prefix_mask;
+
+	rce_coders.prefetch(ctx_prefix + context_prefix_flag);
+
+	if (prefix < 2)
+		rc_p->Encode(prefix);
+	else if (prefix < 10)
+	{
+		rc_p->Encode(prefix);
+		uint64_t ctx_suf = context_suffix_flag;
+		ctx_suf += ((context_t)symbol) << 8;
+		ctx_suf += (context_t) prefix;
+		uint32_t max_value_for_this_prefix = 1u << (prefix - 1);
+
+		auto rc_s = find_rce_coder(ctx_suf, max_value_for_this_prefix, 15);
+		rc_s->Encode(len - max_value_for_this_prefix);
+	}
+	else
+	{
+		rc_p->Encode(10);		// flag for large value
+
+		context_t ctx_large1 = context_large_value1_flag;
+		ctx_large1 += ((context_t)symbol) << 16;
+		auto rc_l1 = find_rce_coder(ctx_large1, 256, 15);
+		uint32_t lv1 = (len >> 16) & 0xff;
+		rc_l1->Encode(lv1);
+
+		context_t ctx_large2 = context_large_value2_flag;
+		ctx_large2 += ((context_t)symbol) << 16;
+		ctx_large2 += (context_t) lv1;
+		auto rc_l2 = find_rce_coder(ctx_large2, 256, 15);
+		uint32_t lv2 = (len >> 8) & 0xff;
+		rc_l2->Encode(lv2);
+
+		context_t ctx_large3 = context_large_value3_flag;
+		ctx_large3 += ((context_t)symbol) << 16;
+		ctx_large3 += ((context_t) lv1) << 8;
+		ctx_large3 += (context_t) lv2;
+		auto rc_l3 = find_rce_coder(ctx_large3, 256, 15);
+		uint32_t lv3 = len & 0xff;
+		rc_l3->Encode(lv3);
+	}
+}
+
+// ************************************************************************************
+void CBlockCoder::decode_run_len(uint8_t &symbol, uint32_t &len)
+{
+	// Decode symbol
+	auto rc_sym = find_rcd_coder(ctx_symbol + context_symbol_flag, 4, 15);
+	symbol = (uint8_t) rc_sym->Decode();
+	ctx_symbol <<= 4;
+	ctx_symbol += (context_t) symbol;
+	ctx_symbol &= context_symbol_mask;
+
+	rcd_coders.prefetch(ctx_symbol + context_symbol_flag);
+
+	ctx_prefix <<= 4;
+	ctx_prefix += (context_t)symbol;
+	ctx_prefix &= context_prefix_mask;
+
+	// Decode run length
+	auto rc_p = find_rcd_coder(ctx_prefix + context_prefix_flag, 11, 10);
+
+	uint32_t prefix = rc_p->Decode();
+
+	if (prefix < 2)
+		len = prefix;
+	else if (prefix < 10)
+	{
+		uint64_t ctx_suf = context_suffix_flag;
+		ctx_suf += ((context_t)symbol) << 8;
+		ctx_suf += (context_t)prefix;
+		uint32_t max_value_for_this_prefix = 1u << (prefix - 1);
+
+		auto rc_s = find_rcd_coder(ctx_suf, max_value_for_this_prefix, 15);
+		len = max_value_for_this_prefix + rc_s->Decode();
+	}
+	else
+	{
+		context_t ctx_large1 = context_large_value1_flag;
+		ctx_large1 += ((context_t)symbol) << 16;
+		auto rc_l1 = find_rcd_coder(ctx_large1, 256, 15);
+		uint32_t lv1 = rc_l1->Decode();
+
+		context_t ctx_large2 = context_large_value2_flag;
+		ctx_large2 += ((context_t)symbol) << 16;
+		ctx_large2 += (context_t) lv1;
+		auto rc_l2 = find_rcd_coder(ctx_large2, 256, 15);
+		uint32_t lv2 = rc_l2->Decode();
+
+		context_t ctx_large3 = context_large_value3_flag;
+		ctx_large3 += ((context_t)symbol) << 16;
+		ctx_large3 += ((context_t) lv1) << 8;
+		ctx_large3 += (context_t) lv2;
+		auto rc_l3 = find_rcd_coder(ctx_large3, 256, 15);
+		uint32_t lv3 = rc_l3->Decode();
+
+		len = (lv1 << 16) + (lv2 << 8) + lv3;
+
+		prefix = ilog2(len);
+	}
+
+	ctx_prefix <<= 4;
+	ctx_prefix += (context_t)prefix;
+	ctx_prefix &= context_prefix_mask;
+
+	rcd_coders.prefetch(ctx_prefix + context_prefix_flag);
+}
+
+// EOF
@@ -0,0 +1,69 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include <vector>
+#include "defs.h"
+#include "io.h"
+#include "rc.h"
+#include "sub_rc.h"
+#include "context_hm.h"
+
+using namespace std;
+
+// *******************************************************************************************
+// Range coder of run-length encoded PBWT rows of a single block of variants.
+// Models are restarted for each block, so blocks can be (de)compressed independently.
+class CBlockCoder
+{
+	vector<uint8_t> v_data;
+	CVectorIOStream *vios;
+	CMemoryInStream *mis;
+
+	CRangeEncoder<CVectorIOStream> *rce;
+	CRangeDecoder<CMemoryInStream> *rcd;
+
+	const context_t context_symbol_flag = 1ull << 60;
+	const context_t context_symbol_mask = 0xffff;
+
+	const context_t context_prefix_mask = 0xfffff;
+	const context_t context_prefix_flag = 2ull << 60;
+	const context_t context_suffix_flag = 3ull << 60;
+	const context_t context_large_value1_flag = 4ull << 60;
+	const context_t context_large_value2_flag = 5ull << 60;
+	const context_t context_large_value3_flag = 6ull << 60;
+
+	context_t ctx_prefix;
+	context_t ctx_symbol;
+
+	typedef CContextHM<CRangeCoderModel<CVectorIOStream>> ctx_map_e_t;
+	typedef CContextHM<CRangeCoderModel<CMemoryInStream>> ctx_map_d_t;
+
+	ctx_map_e_t rce_coders;
+	ctx_map_d_t rcd_coders;
+
+	inline ctx_map_e_t::value_type find_rce_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter);
+	inline ctx_map_d_t::value_type find_rcd_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter);
+
+	inline void encode_run_len(uint8_t symbol, uint32_t len);
+	inline void decode_run_len(uint8_t &symbol, uint32_t &len);
+
+public:
+	CBlockCoder();
+	~CBlockCoder();
+
+	void StartEncoding();
+	void EncodeRow(const vector<pair<uint8_t, uint32_t>> &v_rle);
+	void EndEncoding(vector<uint8_t> &v_stream);
+
+	void StartDecoding(const uint8_t *stream, size_t size);
+	bool DecodeRow(uint32_t no_items, vector<pair<uint8_t, uint32_t>> &v_rle);
+};
+
+// EOF
@@ -9,6 +9,9 @@
 
 #include <memory>
 #include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <cstdio>
 
 using namespace std;
 
@@ -17,7 +20,7 @@ using namespace std;
 #include "utils.h"
 
 // ************************************************************************************
-void CCompressedFile::append(vector<uint8_t> &v_comp, string x)
+void CCompressedFile::append(vector<uint8_t> &v_comp, const string &x)
 {
 	v_comp.insert(v_comp.end(), x.begin(), x.end());
 	v_comp.push_back(0);
@@ -29,14 +32,25 @@ void CCompressedFile::append(vector<uint8_t> &v_comp, int64_t x)
 	append(v_comp, to_string(x));
 }
 
+// ************************************************************************************
+// LEB128-like encoding of unsigned integers
+void CCompressedFile::append_varint(vector<uint8_t> &v_comp, uint64_t x)
+{
+	while (x >= 0x80u)
+	{
+		v_comp.push_back((uint8_t) (x | 0x80u));
+		x >>= 7;
+	}
+	v_comp.push_back((uint8_t) x);
+}
+
 // ************************************************************************************
 void CCompressedFile::read(vector<uint8_t> &v_comp, size_t &pos, string &x)
 {
-	x.clear();
+	auto p = find(v_comp.begin() + pos, v_comp.end(), 0);
 
-	for (; pos < v_comp.size() && v_comp[pos] != 0; ++pos)
-		x.push_back(v_comp[pos]);
-	++pos;
+	x.assign(v_comp.begin() + pos, p);
+	pos = (p - v_comp.begin()) + 1;
 }
 
 // ************************************************************************************
@@ -48,10 +62,511 @@ void CCompressedFile::read(vector<uint8_t> &v_comp, size_t &pos, int64_t &x)
 	x = stoll(t);
 }
 
+// ************************************************************************************
+// The text (without the terminating zero) is viewed in v_comp; returns false if the text is not terminated
+bool CCompressedFile::read(vector<uint8_t> &v_comp, size_t &pos, text_view_t &x)
+{
+	if (pos >= v_comp.size())
+	{
+		x.size = 0;
+		return false;
+	}
+
+	auto p = find(v_comp.begin() + pos, v_comp.end(), 0);
+
+	x.data = (const char *) v_comp.data() + pos;
+	x.size = (size_t) (p - v_comp.begin()) - pos;
+	pos += x.size + 1;
+
+	return p != v_comp.end();
+}
+
+// ************************************************************************************
+uint64_t CCompressedFile::read_varint(vector<uint8_t> &v_comp, size_t &pos)
+{
+	uint64_t x = 0;
+
+	for (uint32_t shift = 0; pos < v_comp.size(); shift += 7)
+	{
+		uint8_t c = v_comp[pos++];
+		x += ((uint64_t) (c & 0x7fu)) << shift;
+		if (!(c & 0x80u))
+			break;
+	}
+
+	return x;
+}
+
+// ************************************************************************************
+// Returns false if there are less than len bytes left
+bool CCompressedFile::read_bytes(vector<uint8_t> &v_comp, size_t &pos, size_t len, text_view_t &x)
+{
+	if (len > v_comp.size() - pos)
+		return false;
+
+	x.data = (const char *) v_comp.data() + pos;
+	x.size = len;
+	pos += len;
+
+	return true;
+}
+
+// ************************************************************************************
+// Check whether id is of the form rs<number> (without leading zeros) and extract the number
+static bool parse_rs_id(const string &id, uint64_t &x)
+{
+	if (id.size() < 3 || id.size() > 20 || id[0] != 'r' || id[1] != 's' || id[2] == '0')
+		return false;
+
+	x = 0;
+	for (size_t i = 2; i < id.size(); ++i)
+	{
+		if (id[i] < '0' || id[i] > '9')
+			return false;
+		x = x * 10 + (uint64_t) (id[i] - '0');
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// Chromosomes are stored as runs of [contig id, run length]; the name of a contig follows its first id in the block
+// (the id is appended when the run starts, the length when it ends)
+void CCompressedFile::flush_contig_run(desc_columns_t &dc)
+{
+	if (!dc.contig_run_len)
+		return;
+
+	append_varint((*dc.columns)[dc_chrom], dc.contig_run_len);
+	dc.contig_run_len = 0;
+}
+
+// ************************************************************************************
+void CCompressedFile::append_desc(desc_columns_t &dc, const variant_desc_t &desc)
+{
+	auto &v_data = *dc.columns;
+
+	// CHROM
+	if (!dc.contig_run_len || dc.v_contigs[dc.cur_contig] != desc.chrom)
+	{
+		flush_contig_run(dc);
+
+		auto p = dc.m_contigs.find(desc.chrom);
+		if (p == dc.m_contigs.end())
+		{
+			dc.cur_contig = (uint32_t) dc.v_contigs.size();
+			dc.m_contigs[desc.chrom] = dc.cur_contig;
+			dc.v_contigs.push_back(desc.chrom);
+			append_varint(v_data[dc_chrom], dc.cur_contig);
+			append(v_data[dc_chrom], desc.chrom);
+		}
+		else
+		{
+			dc.cur_contig = p->second;
+			append_varint(v_data[dc_chrom], dc.cur_contig);
+		}
+	}
+	++dc.contig_run_len;
+
+	// POS - zig-zag coded deltas
+	int64_t delta = desc.pos - dc.prev_pos;
+	append_varint(v_data[dc_pos], delta >= 0 ? ((uint64_t) delta) << 1 : ((((uint64_t) -(delta + 1)) << 1) | 1u));
+	dc.prev_pos = desc.pos;
+
+	// ID - flag: 0 (missing), 1 (rs number), 2 (text)
+	uint64_t rs_num;
+	if (desc.id == ".")
+		v_data[dc_id].push_back(0);
+	else if (parse_rs_id(desc.id, rs_num))
+	{
+		v_data[dc_id].push_back(1);
+		append_varint(v_data[dc_id_num], rs_num);
+	}
+	else
+	{
+		v_data[dc_id].push_back(2);
+		append(v_data[dc_id], desc.id);
+	}
+
+	// REF, ALT - lengths and raw alleles
+	append_varint(v_data[dc_allele_len], desc.ref.size());
+	append_varint(v_data[dc_allele_len], desc.alt.size());
+	v_data[dc_ref].insert(v_data[dc_ref].end(), desc.ref.begin(), desc.ref.end());
+	v_data[dc_alt].insert(v_data[dc_alt].end(), desc.alt.begin(), desc.alt.end());
+
+	append(v_data[dc_qual], desc.qual);
+	append(v_data[dc_info], desc.info);
+
+	// FILTER - id in the dictionary of the block; the text follows the first occurrence of the id
+	auto p = dc.m_filters.find(desc.filter);
+	if (p == dc.m_filters.end())
+	{
+		uint32_t filter_id = (uint32_t) dc.m_filters.size();
+		dc.m_filters[desc.filter] = filter_id;
+		append_varint(v_data[dc_filter], filter_id);
+		append(v_data[dc_filter], desc.filter);
+	}
+	else
+		append_varint(v_data[dc_filter], p->second);
+}
+
+// ************************************************************************************
+// Read description of the next variant as views into the columns (positions are delta coded within a block)
+// Returns false if the columns are corrupted (each description takes at least a byte of each column it uses)
+bool CCompressedFile::read_desc(desc_columns_t &dc, variant_desc_view_t &desc)
+{
+	static const text_view_t missing = { ".", 1 };
+
+	if (!dc.loaded && !unpack_desc_columns(dc))
+		return false;
+
+	auto &v_data = *dc.columns;
+	auto exhausted = [&](desc_column_t c) {return dc.v_pos[c] >= v_data[c].size(); };
+
+	// CHROM
+	if (!dc.contig_run_len)
+	{
+		auto &v = v_data[dc_chrom];
+		auto &p = dc.v_pos[dc_chrom];
+
+		if (exhausted(dc_chrom))
+			return false;
+
+		dc.cur_contig = (uint32_t) read_varint(v, p);
+		if (dc.cur_contig > dc.v_contig_views.size())
+			return false;
+		if (dc.cur_contig == dc.v_contig_views.size())
+		{
+			dc.v_contig_views.emplace_back();
+			if (!read(v, p, dc.v_contig_views.back()))
+				return false;
+		}
+		if (exhausted(dc_chrom))
+			return false;
+		dc.contig_run_len = (uint32_t) read_varint(v, p);
+		if (!dc.contig_run_len)
+			return false;
+	}
+	--dc.contig_run_len;
+	desc.chrom_id = dc.cur_contig;
+	desc.chrom = dc.v_contig_views[dc.cur_contig];
+
+	// POS
+	if (exhausted(dc_pos))
+		return false;
+	uint64_t x = read_varint(v_data[dc_pos], dc.v_pos[dc_pos]);
+	dc.prev_pos += (x & 1u) ? -(int64_t) (x >> 1) - 1 : (int64_t) (x >> 1);
+	desc.pos = dc.prev_pos;
+
+	// ID (converted to text when the columns are unpacked)
+	if (desc_fields & df_id)
+	{
+		if (!read(v_data[dc_id], dc.v_pos[dc_id], desc.id))
+			return false;
+	}
+	else
+		desc.id = missing;
+
+	// REF, ALT
+	if (!(desc_fields & df_ref_alt))
+	{
+		desc.ref = missing;
+		desc.alt = missing;
+	}
+	else
+	{
+		if (exhausted(dc_allele_len))
+			return false;
+		size_t ref_len = read_varint(v_data[dc_allele_len], dc.v_pos[dc_allele_len]);
+		if (exhausted(dc_allele_len))
+			return false;
+		size_t alt_len = read_varint(v_data[dc_allele_len], dc.v_pos[dc_allele_len]);
+		if (!read_bytes(v_data[dc_ref], dc.v_pos[dc_ref], ref_len, desc.ref) ||
+			!read_bytes(v_data[dc_alt], dc.v_pos[dc_alt], alt_len, desc.alt))
+			return false;
+	}
+
+	for (auto d : {
+		make_tuple(dc_qual, df_qual, &desc.qual),
+		make_tuple(dc_info, df_info, &desc.info)
+		})
+	{
+		if (desc_fields & get<1>(d))
+		{
+			if (!read(v_data[get<0>(d)], dc.v_pos[get<0>(d)], *get<2>(d)))
+				return false;
+		}
+		else
+			*get<2>(d) = missing;
+	}
+
+	// FILTER
+	if (desc_fields & df_filter)
+	{
+		auto &v = v_data[dc_filter];
+		auto &p = dc.v_pos[dc_filter];
+
+		if (exhausted(dc_filter))
+			return false;
+
+		desc.filter_id = (uint32_t) read_varint(v, p);
+		if (desc.filter_id > dc.v_filter_views.size())
+			return false;
+		if (desc.filter_id == dc.v_filter_views.size())
+		{
+			dc.v_filter_views.emplace_back();
+			if (!read(v, p, dc.v_filter_views.back()))
+				return false;
+		}
+		desc.filter = dc.v_filter_views[desc.filter_id];
+	}
+	else
+	{
+		desc.filter_id = 0;
+		desc.filter = missing;
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// Read description of the next variant as a copy of its fields
+bool CCompressedFile::read_desc(desc_columns_t &dc, variant_desc_t &desc)
+{
+	variant_desc_view_t view;
+
+	if (!read_desc(dc, view))
+		return false;
+
+	desc.chrom.assign(view.chrom.data, view.chrom.size);
+	desc.pos = view.pos;
+	desc.id.assign(view.id.data, view.id.size);
+	desc.ref.assign(view.ref.data, view.ref.size);
+	desc.alt.assign(view.alt.data, view.alt.size);
+	desc.qual.assign(view.qual.data, view.qual.size);
+	desc.filter.assign(view.filter.data, view.filter.size);
+	desc.info.assign(view.info.data, view.info.size);
+
+	return true;
+}
+
+// ************************************************************************************
+// IDs are stored as flags: 0 (missing), 1 (rs number in a separate column), 2 (text); they are converted to zero-terminated texts
+void CCompressedFile::format_ids(desc_column_data_t &v_data)
+{
+	auto &v_id = v_data[dc_id];
+	vector<uint8_t> v_text;
+	size_t p_num = 0;
+	char buf[32];
+
+	v_text.reserve(v_id.size() + 4 * v_data[dc_id_num].size());
+
+	for (size_t p = 0; p < v_id.size(); )
+	{
+		uint8_t id_flag = v_id[p++];
+
+		if (id_flag == 0)
+			v_text.push_back('.');
+		else if (id_flag == 1)
+		{
+			int len = snprintf(buf, sizeof(buf), "rs%llu", (unsigned long long) read_varint(v_data[dc_id_num], p_num));
+			v_text.insert(v_text.end(), buf, buf + len);
+		}
+		else
+		{
+			for (; p < v_id.size() && v_id[p]; ++p)
+				v_text.push_back(v_id[p]);
+			++p;		// terminating zero
+		}
+
+		v_text.push_back(0);
+	}
+
+	swap(v_id, v_text);
+}
+
+// ************************************************************************************
+void CCompressedFile::clear_desc_columns(desc_columns_t &dc)
+{
+	if (!dc.columns)
+		dc.columns = make_shared<desc_column_data_t>();
+	for (auto &v : *dc.columns)
+		v.clear();
+	fill(dc.v_pos.begin(), dc.v_pos.end(), 0u);
+
+	dc.prev_pos = 0;
+	dc.v_contigs.clear();
+	dc.m_contigs.clear();
+	dc.m_filters.clear();
+	dc.v_contig_views.clear();
+	dc.v_filter_views.clear();
+	dc.cur_contig = 0;
+	dc.contig_run_len = 0;
+	dc.loaded = false;
+}
+
+// ************************************************************************************
+// Compress description columns of a block into a chunk of [size (4B), LZMA data] items; the columns are cleared
+void CCompressedFile::pack_desc_columns(desc_columns_t &dc, vector<uint8_t> &v_chunk)
+{
+	vector<uint8_t> v_comp;
+
+	v_chunk.clear();
+	flush_contig_run(dc);
+
+	for (auto &v : *dc.columns)
+	{
+		v_comp.clear();
+		CLZMAWrapper::Compress(v, v_comp, 9);
+
+		for (int i = 0; i < 4; ++i)
+			v_chunk.push_back((uint8_t) (v_comp.size() >> (8 * i)));
+		v_chunk.insert(v_chunk.end(), v_comp.begin(), v_comp.end());
+	}
+
+	clear_desc_columns(dc);
+}
+
+// ************************************************************************************
+// Decompress the columns of the requested fields only from the chunk of descriptions of the block
+// (columns are decompressed by up to dc.no_threads threads; can be called concurrently for different dc)
+bool CCompressedFile::unpack_desc_columns(desc_columns_t &dc)
+{
+	const array<uint32_t, dc_no_columns> a_column_fields = { 0, 0, df_id, df_id, df_ref_alt, df_ref_alt, df_ref_alt, df_qual, df_filter, df_info };
+	array<pair<size_t, size_t>, dc_no_columns> a_ranges;
+	auto &b = v_blocks[dc.block_id];
+	size_t p = 0;
+
+	if (b.db_offset + b.db_size > fi_db.FileSize())
+		return false;
+
+	const uint8_t *chunk = fi_db.Data(b.db_offset);
+
+	for (auto &r : a_ranges)
+	{
+		if (p + 4 > b.db_size)
+			return false;
+
+		size_t size = 0;
+		for (int i = 0; i < 4; ++i)
+			size += ((size_t) chunk[p++]) << (8 * i);
+
+		if (p + size > b.db_size)
+			return false;
+
+		r = make_pair(p, size);
+		p += size;
+	}
+
+	auto &v_data = *dc.columns;
+	array<char, dc_no_columns> a_ok;
+
+	parallel_for(dc_no_columns, dc.no_threads, [&](size_t i) {
+		a_ok[i] = !a_ranges[i].second || (a_column_fields[i] != 0 && !(desc_fields & a_column_fields[i])) ||
+			CLZMAWrapper::Decompress(chunk + a_ranges[i].first, a_ranges[i].second, v_data[i]);
+	});
+
+	for (auto x : a_ok)
+		if (!x)
+			return false;
+
+	if (desc_fields & df_id)
+		format_ids(v_data);
+
+	dc.loaded = true;
+
+	return true;
+}
+
+// ************************************************************************************
+// Prepare reading of descriptions of variants of the block (nothing is loaded until the first description is read)
+void CCompressedFile::start_desc_columns(uint32_t block_id, desc_columns_t &dc, uint32_t _no_threads)
+{
+	// Columns of the previous block can still be viewed by descriptions
+	dc.columns.reset();
+	clear_desc_columns(dc);
+
+	dc.block_id = block_id;
+	dc.no_threads = _no_threads;
+}
+
+// ************************************************************************************
+// Convert haplotype values to the per-sample genotypes used by CVCF
+void CCompressedFile::make_sample_data(const vector<uint8_t> &v_gt, vector<uint8_t> &data)
+{
+	data.resize(no_samples);
+
+	if (ploidy == 1)
+	{ 
+		for (uint32_t i = 0; i < no_samples; ++i)
+			data[i] = v_gt[i];
+	}
+	else if (ploidy == 2)
+	{
+		for(uint32_t i = 0; i < no_samples * ploidy; ++i)
+
+		if (i % 2 == 0)
+			data[i / 2] = 0b00010000 + v_gt[i];
+		else
+			data[i / 2] += (uint8_t)(v_gt[i] << 2u);
+	}
+}
+
+// ************************************************************************************
+// Restore PBWT permutation from the ranks of haplotypes
+void CCompressedFile::decode_checkpoint(const uint8_t *checkpoint, vector<int> &_v_perm)
+{
+	uint32_t no_items = no_samples * ploidy;
+	uint32_t width = (uint32_t) no_bytes(no_items - 1);
+
+	_v_perm.resize(no_items);
+	auto p = checkpoint;
+	for (uint32_t i = 0; i < no_items; ++i)
+	{
+		uint32_t rank = 0;
+		for (uint32_t j = 0; j < width; ++j)
+			rank += ((uint32_t) *p++) << (8 * j);
+		_v_perm[rank] = (int) i;
+	}
+}
+
+// ************************************************************************************
+// Locate the checkpoint and the range coded stream of the block in the memory mapped _gt file
+bool CCompressedFile::get_block_gt(uint32_t block_id, const uint8_t *&checkpoint, const uint8_t *&stream, size_t &stream_size)
+{
+	auto &b = v_blocks[block_id];
+	uint64_t block_end = block_id + 1 < v_blocks.size() ? v_blocks[block_id + 1].gt_offset : fi_gt.FileSize();
+	uint32_t no_items = no_samples * ploidy;
+	uint64_t checkpoint_size = no_items * no_bytes(no_items - 1);
+
+	if (b.gt_offset + checkpoint_size > block_end || block_end > fi_gt.FileSize())
+		return false;
+
+	fi_gt.WillNeed(b.gt_offset, block_end - b.gt_offset);
+
+	checkpoint = fi_gt.Data(b.gt_offset);
+	stream = checkpoint + checkpoint_size;
+	stream_size = block_end - b.gt_offset - checkpoint_size;
+
+	return true;
+}
+
 // ************************************************************************************
 bool CCompressedFile::load_descriptions()
 {
 	string s;
+	uint8_t footer[8];
+
+	// Characteristics of the archive are stored after descriptions of blocks
+	if (fi_db.FileSize() < 8 || !fi_db.ReadAt(fi_db.FileSize() - 8, footer, 8))
+		return false;
+
+	uint64_t desc_pos = 0;
+	for (int i = 0; i < 8; ++i)
+		desc_pos += ((uint64_t) footer[i]) << (8 * i);
+
+	if (!fi_db.Seek(desc_pos))
+		return false;
 
 	// Load file header and characteristics
 	no_variants = (uint32_t) fi_db.ReadUInt(4);
@@ -59,30 +574,29 @@ bool CCompressedFile::load_descriptions()
 	no_samples = (uint32_t) fi_db.ReadUInt(4);
 	ploidy = (uint8_t) fi_db.ReadUInt(1);
 	neglect_limit = (uint32_t) fi_db.ReadUInt(4);
+	no_variants_in_block = (uint32_t) fi_db.ReadUInt(4);
 
-	// Load variant descriptions
-	for (auto d : {
-		make_tuple(ref(v_rd_meta), ref(v_cd_meta), ref(p_meta), "meta"),
-		make_tuple(ref(v_rd_header), ref(v_cd_header), ref(p_header), "header"),
-		make_tuple(ref(v_rd_samples), ref(v_cd_samples), ref(p_samples), "samples"),
-		make_tuple(ref(v_rd_chrom), ref(v_cd_chrom), ref(p_chrom), "chrom"),
-		make_tuple(ref(v_rd_pos), ref(v_cd_pos), ref(p_pos), "pos"),
-		make_tuple(ref(v_rd_id), ref(v_cd_id), ref(p_id), "id"),
-		make_tuple(ref(v_rd_ref), ref(v_cd_ref), ref(p_ref), "ref"),
-		make_tuple(ref(v_rd_alt), ref(v_cd_alt), ref(p_alt), "alt"),
-		make_tuple(ref(v_rd_qual), ref(v_cd_qual), ref(p_qual), "qual"),
-		make_tuple(ref(v_rd_filter), ref(v_cd_filter), ref(p_filter), "filter"),
-		make_tuple(ref(v_rd_info), ref(v_cd_info), ref(p_info), "info")
-		})
+	// Load archive descriptions (columns are decompressed in parallel)
+	vector<tuple<vector<uint8_t>*, vector<uint8_t>*, size_t*>> v_columns = {
+		make_tuple(&v_rd_meta, &v_cd_meta, &p_meta),
+		make_tuple(&v_rd_header, &v_cd_header, &p_header),
+		make_tuple(&v_rd_samples, &v_cd_samples, &p_samples),
+		make_tuple(&v_rd_blocks, &v_cd_blocks, &p_blocks)
+	};
+
+	for (auto &d : v_columns)
 	{
 		size_t field_len = fi_db.ReadUInt(4);
 
-		get<1>(d).resize(field_len);
-		fi_db.Read(get<1>(d).data(), field_len);
-		CLZMAWrapper::Decompress(get<1>(d), get<0>(d));
+		get<1>(d)->resize(field_len);
+		fi_db.Read(get<1>(d)->data(), field_len);
 
-		get<2>(d) = 0;
+		*get<2>(d) = 0;
 	}
+
+	parallel_for(v_columns.size(), no_threads, [&](size_t i) {
+		CLZMAWrapper::Decompress(*get<1>(v_columns[i]), *get<0>(v_columns[i]));
+	});
 	
 	v_meta.clear();
 	read(v_rd_meta, p_meta, v_meta);
@@ -98,44 +612,481 @@ bool CCompressedFile::load_descriptions()
 		v_samples.push_back(sample);
 	}
 
+	load_block_index();
+
+	return true;
+}
+
+// ************************************************************************************
+bool CCompressedFile::save_descriptions()
+{
+	uint64_t desc_pos = db_file_pos;
+
+	// Save file header and characteristics
+	fo_db.WriteUInt(no_variants, 4);
+	fo_db.WriteUInt(no_samples, 4);
+	fo_db.WriteUInt(ploidy, 1);
+	fo_db.WriteUInt(neglect_limit, 4);
+	fo_db.WriteUInt(no_variants_in_block, 4);
+
+	append(v_rd_meta, v_meta);
+	append(v_rd_header, v_header);
+
+	for (auto &x : v_samples)
+		append(v_rd_samples, x);
+
+	store_block_index();
+
+	// Save archive descriptions (columns are compressed in parallel)
+	vector<tuple<vector<uint8_t>*, vector<uint8_t>*, int, string>> v_columns = {
+		make_tuple(&v_rd_meta, &v_cd_meta, 9, "meta"),
+		make_tuple(&v_rd_header, &v_cd_header, 9, "header"),
+		make_tuple(&v_rd_samples, &v_cd_samples, 9, "samples"),
+		make_tuple(&v_rd_blocks, &v_cd_blocks, 9, "blocks")
+	};
+
+	parallel_for(v_columns.size(), no_threads, [&](size_t i) {
+		CLZMAWrapper::Compress(*get<0>(v_columns[i]), *get<1>(v_columns[i]), get<2>(v_columns[i]));
+	});
+
+	for (auto &d : v_columns)
+	{
+		cout << get<3>(d) << " size: " << get<1>(d)->size() << endl;
+		fo_db.WriteUInt(get<1>(d)->size(), 4);
+		fo_db.Write(get<1>(d)->data(), get<1>(d)->size());
+	}
+
+	fo_db.WriteUInt(desc_pos, 8);
+
+	return true;
+}
+
+// ************************************************************************************
+void CCompressedFile::store_block_index()
+{
+	append(v_rd_blocks, (int64_t) v_blocks.size());
+
+	for (auto &x : v_blocks)
+	{
+		append(v_rd_blocks, (int64_t) x.gt_offset);
+		append(v_rd_blocks, (int64_t) x.first_variant);
+		append(v_rd_blocks, (int64_t) x.no_variants);
+
+		append(v_rd_blocks, (int64_t) x.db_offset);
+		append(v_rd_blocks, (int64_t) x.db_size);
+
+		append(v_rd_blocks, (int64_t) x.v_contigs.size());
+		for (auto &y : x.v_contigs)
+		{
+			append(v_rd_blocks, y.chrom);
+			append(v_rd_blocks, y.min_pos);
+			append(v_rd_blocks, y.max_pos);
+		}
+	}
+}
+
+// ************************************************************************************
+void CCompressedFile::load_block_index()
+{
+	int64_t no_blocks;
+	int64_t x;
+
+	v_blocks.clear();
+	read(v_rd_blocks, p_blocks, no_blocks);
+	v_blocks.resize((size_t) no_blocks);
+
+	m_contig_blocks.clear();
+
+	for (uint32_t i = 0; i < v_blocks.size(); ++i)
+	{
+		auto &b = v_blocks[i];
+
+		read(v_rd_blocks, p_blocks, x);		b.gt_offset = (uint64_t) x;
+		read(v_rd_blocks, p_blocks, x);		b.first_variant = (uint32_t) x;
+		read(v_rd_blocks, p_blocks, x);		b.no_variants = (uint32_t) x;
+
+		read(v_rd_blocks, p_blocks, x);		b.db_offset = (uint64_t) x;
+		read(v_rd_blocks, p_blocks, x);		b.db_size = (uint64_t) x;
+
+		read(v_rd_blocks, p_blocks, x);
+		b.v_contigs.resize((size_t) x);
+		for (auto &y : b.v_contigs)
+		{
+			read(v_rd_blocks, p_blocks, y.chrom);
+			read(v_rd_blocks, p_blocks, y.min_pos);
+			read(v_rd_blocks, p_blocks, y.max_pos);
+
+			// Per-chromosome position index
+			m_contig_blocks[y.chrom].push_back(make_pair(i, y));
+		}
+	}
+
+	i_block = 0;
+}
+
+// ************************************************************************************
+// Start a new block of genotypes: store the PBWT permutation checkpoint and restart the range coder
+void CCompressedFile::start_block(const variant_desc_t &desc)
+{
+	v_blocks.push_back(block_desc_t());
+
+	auto &b = v_blocks.back();
+	b.gt_offset = 0;
+	b.first_variant = no_variants;
+	b.no_variants = 0;
+	b.db_offset = 0;
+	b.db_size = 0;
+
+	CThreadPool::Instance().Reserve(no_threads);
+
+	gt_cur = get_gt_block();
+	gt_cur->block_id = (uint32_t) v_blocks.size() - 1;
+	clear_desc_columns(gt_cur->desc);
+
+	uint32_t width = (uint32_t) no_bytes(no_samples * ploidy - 1);
+
+	// Checkpoint contains ranks of haplotypes in the PBWT order, so a single haplotype can be located by a direct read
+	pbwt.GetPermutation(v_perm);
+	gt_cur->v_checkpoint.resize(v_perm.size() * width);
+	for (uint32_t i = 0; i < v_perm.size(); ++i)
+		for (uint32_t j = 0; j < width; ++j)
+			gt_cur->v_checkpoint[v_perm[i] * width + j] = (uint8_t) (i >> (8 * j));
+}
+
+// ************************************************************************************
+// Pass the block to the thread pool for compression
+void CCompressedFile::end_block()
+{
+	gt_block_t *b = gt_cur;
+
+	{
+		lock_guard<mutex> lck(mtx_gt);
+		q_gt_pending.push_back(b);
+	}
+	CThreadPool::Instance().Submit([this, b] {code_gt_block(b); });
+	gt_cur = nullptr;
+
+	write_blocks(false);
+}
+
+// ************************************************************************************
+// Store compressed blocks in the file order (wait for them if there are too many in progress or flush_all is set)
+void CCompressedFile::write_blocks(bool flush_all)
+{
+	unique_lock<mutex> lck(mtx_gt);
+
+	while (!q_gt_pending.empty())
+	{
+		auto b = q_gt_pending.front();
+
+		if (!b->ready)
+		{
+			if (!flush_all && q_gt_pending.size() <= 2 * no_threads)
+				break;
+			cv_gt.wait(lck, [b] {return b->ready; });
+		}
+
+		q_gt_pending.pop_front();
+		lck.unlock();
+
+		v_blocks[b->block_id].gt_offset = gt_file_pos;
+		fo_gt.Write(b->v_checkpoint.data(), b->v_checkpoint.size());
+		fo_gt.Write(b->v_stream.data(), b->v_stream.size());
+
+		gt_file_pos += b->v_checkpoint.size() + b->v_stream.size();
+
+		// Descriptions of variants of the block
+		v_blocks[b->block_id].db_offset = db_file_pos;
+		v_blocks[b->block_id].db_size = b->v_desc_chunk.size();
+		fo_db.Write(b->v_desc_chunk.data(), b->v_desc_chunk.size());
+
+		db_file_pos += b->v_desc_chunk.size();
+
+		lck.lock();
+		v_gt_free.push_back(b);
+	}
+}
+
+// ************************************************************************************
+void CCompressedFile::code_gt_block(gt_block_t *b)
+{
+	CBlockCoder coder;
+
+	coder.StartEncoding();
+	for (uint32_t i = 0; i < b->no_rows; ++i)
+		coder.EncodeRow(b->v_rows[i]);
+	coder.EndEncoding(b->v_stream);
+
+	pack_desc_columns(b->desc, b->v_desc_chunk);
+
+	lock_guard<mutex> lck(mtx_gt);
+	b->ready = true;
+	cv_gt.notify_all();
+}
+
+// ************************************************************************************
+// Blocks still processed in the pool are waited for (decoding of rows that will not be read is cancelled)
+void CCompressedFile::release_gt_blocks()
+{
+	{
+		unique_lock<mutex> lck(mtx_gt);
+		for (auto b : q_gt_pending)
+			b->cancelled = true;
+		for (auto b : q_gt_pending)
+			cv_gt.wait(lck, [b] {return b->ready; });
+	}
+
+	for (auto b : q_gt_pending)
+		delete b;
+	q_gt_pending.clear();
+
+	for (auto b : v_gt_free)
+		delete b;
+	v_gt_free.clear();
+
+	if (gt_cur)
+		delete gt_cur;
+	gt_cur = nullptr;
+}
+
+// ************************************************************************************
+// Recycled block buffer (or a new one)
+CCompressedFile::gt_block_t* CCompressedFile::get_gt_block()
+{
+	gt_block_t *b;
+
+	if (v_gt_free.empty())
+		b = new gt_block_t;
+	else
+	{
+		b = v_gt_free.back();
+		v_gt_free.pop_back();
+	}
+
+	b->no_rows = 0;
+	b->no_rows_ready = 0;
+	b->with_desc = false;
+	b->no_descs_ready = 0;
+	b->no_tasks_left = 1;
+	b->cancelled = false;
+	b->ready = false;
+
+	return b;
+}
+
+// ************************************************************************************
+// Keep range decoding (and decoding of descriptions if requested) of the block and a few following ones in progress in the thread pool
+void CCompressedFile::schedule_gt_blocks(uint32_t block_id, bool with_desc)
+{
+	const uint8_t *checkpoint, *stream;
+	size_t stream_size;
+
+	uint32_t next_id = q_gt_pending.empty() ? block_id : q_gt_pending.back()->block_id + 1;
+
+	for (; q_gt_pending.size() <= no_gt_blocks_ahead && next_id < v_blocks.size(); ++next_id)
+	{
+		if (!get_block_gt(next_id, checkpoint, stream, stream_size))
+			break;
+
+		gt_block_t *b = get_gt_block();
+
+		b->block_id = next_id;
+		b->no_rows = v_blocks[next_id].no_variants;
+		if (b->v_rows.size() < b->no_rows)
+			b->v_rows.resize(b->no_rows);
+
+		b->with_desc = with_desc;
+		if (with_desc)
+		{
+			if (b->v_descs.size() < b->no_rows)
+				b->v_descs.resize(b->no_rows);
+			start_desc_columns(next_id, b->desc, no_threads);
+			b->no_tasks_left = 2;
+		}
+
+		{
+			lock_guard<mutex> lck(mtx_gt);
+			q_gt_pending.push_back(b);
+		}
+		CThreadPool::Instance().Submit([this, b, stream, stream_size] {decode_gt_block(b, stream, stream_size); });
+		if (with_desc)
+			CThreadPool::Instance().Submit([this, b] {decode_desc_block(b); });
+	}
+}
+
+// ************************************************************************************
+// Range decode rows of the block; they are published in small batches, so the PBWT decoding can follow closely
+// (decoding stops at a corrupted row)
+void CCompressedFile::decode_gt_block(gt_block_t *b, const uint8_t *stream, size_t stream_size)
+{
+	CBlockCoder coder;
+	uint32_t no_items = no_samples * ploidy;
+	bool cancelled = false;
+
+	coder.StartDecoding(stream, stream_size);
+
+	for (uint32_t i = 0; i < b->no_rows && !cancelled;)
+	{
+		uint32_t i_end = min(i + no_gt_rows_in_batch, b->no_rows);
+
+		for (; i < i_end; ++i)
+			if (!coder.DecodeRow(no_items, b->v_rows[i]))
+			{
+				cancelled = true;
+				break;
+			}
+
+		lock_guard<mutex> lck(mtx_gt);
+		b->no_rows_ready = i;
+		cancelled |= b->cancelled;
+		cv_gt.notify_all();
+	}
+
+	finish_block_task(b);
+}
+
+// ************************************************************************************
+// Decode descriptions of variants of the block (published in batches as rows; decoding stops at a corrupted description)
+void CCompressedFile::decode_desc_block(gt_block_t *b)
+{
+	bool cancelled = false;
+
+	for (uint32_t i = 0; i < b->no_rows && !cancelled;)
+	{
+		uint32_t i_end = min(i + no_gt_rows_in_batch, b->no_rows);
+
+		for (; i < i_end; ++i)
+			if (!read_desc(b->desc, b->v_descs[i]))
+			{
+				cancelled = true;
+				break;
+			}
+
+		lock_guard<mutex> lck(mtx_gt);
+		b->no_descs_ready = i;
+		cancelled |= b->cancelled;
+		cv_gt.notify_all();
+	}
+
+	finish_block_task(b);
+}
+
+// ************************************************************************************
+// The block is ready when all its tasks are finished
+void CCompressedFile::finish_block_task(gt_block_t *b)
+{
+	lock_guard<mutex> lck(mtx_gt);
+	if (--b->no_tasks_left == 0)
+		b->ready = true;
+	cv_gt.notify_all();
+}
+
+// ************************************************************************************
+// Recycle the buffer of the oldest block in decoding
+void CCompressedFile::retire_gt_block()
+{
+	gt_block_t *b = q_gt_pending.front();
+
+	unique_lock<mutex> lck(mtx_gt);
+	b->cancelled = true;
+	cv_gt.wait(lck, [b] {return b->ready; });
+
+	q_gt_pending.pop_front();
+	v_gt_free.push_back(b);
+}
+
+// ************************************************************************************
+// Next range decoded row of the current block (waits for the decoding task if necessary)
+vector<pair<uint8_t, uint32_t>>* CCompressedFile::next_gt_row()
+{
+	if (q_gt_pending.empty())
+		return nullptr;
+
+	gt_block_t *b = q_gt_pending.front();
+
+	if (i_gt_row >= b->no_rows)
+		return nullptr;
+
+	if (i_gt_row >= no_gt_rows_avail)
+	{
+		unique_lock<mutex> lck(mtx_gt);
+		cv_gt.wait(lck, [this, b] {return b->no_rows_ready > i_gt_row || b->ready; });
+		no_gt_rows_avail = b->no_rows_ready;
+
+		if (i_gt_row >= no_gt_rows_avail)
+			return nullptr;
+	}
+
+	return &b->v_rows[i_gt_row++];
+}
+
+// ************************************************************************************
+// Description of the current variant of the block (must be taken before its row); strings are exchanged, so they are recycled
+bool CCompressedFile::next_gt_desc(variant_desc_t &desc)
+{
+	if (q_gt_pending.empty())
+		return false;
+
+	gt_block_t *b = q_gt_pending.front();
+
+	// The block was scheduled ahead by a reader of genotypes only
+	if (!b->with_desc)
+		return read_desc(desc_cur, desc);
+
+	if (i_gt_row >= b->no_rows)
+		return false;
+
+	if (i_gt_row >= no_gt_descs_avail)
+	{
+		unique_lock<mutex> lck(mtx_gt);
+		cv_gt.wait(lck, [this, b] {return b->no_descs_ready > i_gt_row || b->ready; });
+		no_gt_descs_avail = b->no_descs_ready;
+
+		if (i_gt_row >= no_gt_descs_avail)
+			return false;
+	}
+
+	swap(desc, b->v_descs[i_gt_row]);
+
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::save_descriptions()
+// Load the block of genotypes
+bool CCompressedFile::load_block(uint32_t block_id, bool with_desc)
 {
-	// Save file header and characteristics
-	fo_db.WriteUInt(no_variants, 4);
-	fo_db.WriteUInt(no_samples, 4);
-	fo_db.WriteUInt(ploidy, 1);
-	fo_db.WriteUInt(neglect_limit, 4);
+	if (block_id >= v_blocks.size())
+		return false;
 
-	append(v_rd_meta, v_meta);
-	append(v_rd_header, v_header);
+	// The block read so far (its rows could be taken by the caller) and the blocks decoded ahead are dropped until the requested one
+	if (!q_gt_pending.empty())
+		retire_gt_block();
+	while (!q_gt_pending.empty() && q_gt_pending.front()->block_id != block_id)
+		retire_gt_block();
 
-	for (auto &x : v_samples)
-		append(v_rd_samples, x);
+	CThreadPool::Instance().Reserve(with_desc ? 2 : 1);
+	schedule_gt_blocks(block_id, with_desc);
 
-	// Save variant descriptions
-	for (auto d : {
-		make_tuple(ref(v_rd_meta), ref(v_cd_meta), 9, "meta"),
-		make_tuple(ref(v_rd_header), ref(v_cd_header), 9, "header"),
-		make_tuple(ref(v_rd_samples), ref(v_cd_samples), 9, "samples"),
-		make_tuple(ref(v_rd_chrom), ref(v_cd_chrom), 9, "chrom"),
-		make_tuple(ref(v_rd_pos), ref(v_cd_pos), 9, "pos"),
-		make_tuple(ref(v_rd_id), ref(v_cd_id), 9, "id"),
-		make_tuple(ref(v_rd_ref), ref(v_cd_ref), 9, "ref"),
-		make_tuple(ref(v_rd_alt), ref(v_cd_alt), 9, "alt"),
-		make_tuple(ref(v_rd_qual), ref(v_cd_qual), 9, "qual"),
-		make_tuple(ref(v_rd_filter), ref(v_cd_filter), 9, "filter"),
-		make_tuple(ref(v_rd_info), ref(v_cd_info), 9, "info")
-		})
-	{
-		CLZMAWrapper::Compress(get<0>(d), get<1>(d), get<2>(d));
-		cout << get<3>(d) << " size: " << get<1>(d).size() << endl;
-		fo_db.WriteUInt(get<1>(d).size(), 4);
-		fo_db.Write(get<1>(d).data(), get<1>(d).size());
-	}
+	if (q_gt_pending.empty() || q_gt_pending.front()->block_id != block_id)
+		return false;
+
+	i_gt_row = 0;
+	no_gt_rows_avail = 0;
+	no_gt_descs_avail = 0;
+
+	start_desc_columns(block_id, desc_cur, no_threads);
+
+	i_block = block_id + 1;
+
+	return true;
+}
+
+// ************************************************************************************
+// Switch to the next block if the current variant starts it
+bool CCompressedFile::prepare_variant(bool with_desc)
+{
+	if (i_block < v_blocks.size() && i_variant == v_blocks[i_block].first_variant)
+		return load_block(i_block, with_desc);
 
 	return true;
 }
@@ -145,17 +1096,20 @@ CCompressedFile::CCompressedFile()
 {
 	open_mode = open_mode_t::none;
 
-	rce = nullptr;
-	rcd = nullptr;
+	no_variants_in_block = 1u << 16;
+	no_threads = 1;
+	desc_fields = df_all;
+
+	gt_cur = nullptr;
+	i_gt_row = 0;
+	no_gt_rows_avail = 0;
+	no_gt_descs_avail = 0;
 }
 
 // ************************************************************************************
 CCompressedFile::~CCompressedFile()
 {
-	if (rce)
-		delete rce;
-	if (rcd)
-		delete rcd;
+	release_gt_blocks();
 
 	fo_gt.Close();
 	fo_db.Close();
@@ -164,8 +1118,6 @@ CCompressedFile::~CCompressedFile()
 // ************************************************************************************
 bool CCompressedFile::OpenForReading(string file_name)
 {
-	prev_pos = 0;
-
 	if (!fi_db.Open(file_name + "_db"))
 	{
 		cerr << "Cannot open " << file_name << "_db file\n";
@@ -180,20 +1132,19 @@ bool CCompressedFile::OpenForReading(string file_name)
 
 	open_mode = open_mode_t::reading;
 
-	load_descriptions();
+	if (!load_descriptions())
+	{
+		cerr << "Corrupted " << file_name << "_db file\n";
+		return false;
+	}
 	pbwt_initialised = false;
 
-	rcd = new CRangeDecoder<CInFile>(fi_gt);
-	rcd->Start();
-
 	return true;
 }
 
 // ************************************************************************************
 bool CCompressedFile::OpenForWriting(string file_name)
 {
-	prev_pos = 0;
-
 	if(!fo_db.Open(file_name + "_db"))
 	{
 		cerr << "Cannot open " << file_name << "_db file\n";
@@ -209,10 +1160,10 @@ bool CCompressedFile::OpenForWriting(string file_name)
 	open_mode = open_mode_t::writing;
 	pbwt_initialised = false;
 
-	rce = new CRangeEncoder<COutFile>(fo_gt);
-	rce->Start();
-
 	no_variants = 0;
+	gt_file_pos = 0;
+	db_file_pos = 0;
+	v_blocks.clear();
 
 	return true;
 }
@@ -222,16 +1173,22 @@ bool CCompressedFile::Close()
 {
 	if (open_mode == open_mode_t::writing)
 	{
+		if (!v_blocks.empty())
+		{
+			end_block();
+			write_blocks(true);
+		}
+		release_gt_blocks();
+
 		save_descriptions();
-		rce->End();
-		delete rce;
-		rce = nullptr;
 
 		fo_db.Close();
 		fo_gt.Close();
 	}
 	else if (open_mode == open_mode_t::reading)
 	{
+		release_gt_blocks();
+
 		fi_db.Close();
 		fi_gt.Close();
 	}
@@ -332,407 +1289,414 @@ void CCompressedFile::SetNeglectLimit(uint32_t _neglect_limit)
 }
 
 // ************************************************************************************
-bool CCompressedFile::Eof()
+// No. of range coding threads (must be set before the first variant is stored)
+void CCompressedFile::SetNoThreads(uint32_t _no_threads)
 {
-	if (open_mode == open_mode_t::reading)
-	{
-		return i_variant >= no_variants;
-	}
-
-	return false;
+	no_threads = max(_no_threads, 1u);
 }
 
 // ************************************************************************************
-bool CCompressedFile::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
+// Fields of descriptions to decode when reading (the other ones are returned as '.')
+void CCompressedFile::SetDescFields(uint32_t _desc_fields)
 {
-	desc.chrom.clear();
+	desc_fields = _desc_fields;
+}
 
-	if (i_variant >= no_variants)
-		return false;
+// ************************************************************************************
+uint32_t CCompressedFile::GetNoVariantsInBlock()
+{
+	return no_variants_in_block;
+}
 
-	int64_t pos;
+// ************************************************************************************
+void CCompressedFile::SetNoVariantsInBlock(uint32_t _no_variants_in_block)
+{
+	no_variants_in_block = _no_variants_in_block;
+}
 
-	// Load variant description
-	read(v_rd_chrom, p_chrom, desc.chrom);
-	read(v_rd_pos, p_pos, pos);
-	pos += prev_pos;
-	prev_pos = pos;
-	desc.pos = pos;
-	
-	read(v_rd_id, p_id, desc.id);
-	read(v_rd_ref, p_ref, desc.ref);
-	read(v_rd_alt, p_alt, desc.alt);
-	read(v_rd_qual, p_qual, desc.qual);
-	read(v_rd_filter, p_filter, desc.filter);
-	read(v_rd_info, p_info, desc.info);
+// ************************************************************************************
+uint32_t CCompressedFile::GetNoBlocks()
+{
+	return (uint32_t) v_blocks.size();
+}
 
-	// Load genotypes
-//	v_rd_gt.clear();
-	v_rle_gt.clear();
-	v_rle_gt_large.clear();
-//	data.clear();
+// ************************************************************************************
+uint32_t CCompressedFile::GetBlockFirstVariant(uint32_t block_id)
+{
+	if (block_id >= v_blocks.size())
+		return no_variants;
 
-	uint32_t total_len = 0;
-	ctx_prefix = context_prefix_mask;
-	ctx_symbol = context_symbol_mask;
+	return v_blocks[block_id].first_variant;
+}
 
-	while (total_len < no_samples * ploidy)
-	{
-		uint8_t symbol;
-		uint32_t len;
-		decode_run_len(symbol, len);
+// ************************************************************************************
+// Determine ranges [first, last) of consecutive blocks containing variants from any of the regions
+bool CCompressedFile::GetBlocksForRegions(const vector<region_t> &v_regions, vector<pair<uint32_t, uint32_t>> &v_block_ranges)
+{
+	vector<uint32_t> v_block_ids;
 
-		if (len == 0u)
-			len = no_samples * ploidy - total_len;
+	v_block_ranges.clear();
 
-		v_rle_gt_large.push_back(make_pair(symbol, len));
+	for (auto &r : v_regions)
+	{
+		auto p = m_contig_blocks.find(r.chrom);
+		if (p == m_contig_blocks.end())
+			continue;
 
-		total_len += len;
+		for (auto &x : p->second)
+			if (x.second.min_pos <= r.end && r.start <= x.second.max_pos)
+				v_block_ids.push_back(x.first);
 	}
 
-	pbwt.Decode(v_rle_gt_large, v_rd_gt);
-
-	data.resize(no_samples);
-
-	if (ploidy == 1)
-	{ 
-		for (uint32_t i = 0; i < no_samples; ++i)
-			data[i] = v_rd_gt[i];
-	}
-	else if (ploidy == 2)
-	{
-		for(uint32_t i = 0; i < no_samples * ploidy; ++i)
+	sort(v_block_ids.begin(), v_block_ids.end());
+	v_block_ids.erase(unique(v_block_ids.begin(), v_block_ids.end()), v_block_ids.end());
 
-		if (i % 2 == 0)
-			data[i / 2] = 0b00010000 + v_rd_gt[i];
+	for (auto x : v_block_ids)
+		if (!v_block_ranges.empty() && v_block_ranges.back().second == x)
+			++v_block_ranges.back().second;
 		else
-			data[i / 2] += (uint8_t)(v_rd_gt[i] << 2u);
-	}
-
-	++i_variant;
+			v_block_ranges.push_back(make_pair(x, x + 1));
 
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::SetVariant(variant_desc_t &desc, vector<uint8_t> &data)
+// Prepare independent decoding of the block (can be called concurrently for different readers)
+bool CCompressedFile::StartBlockReading(uint32_t block_id, CBlockReader &reader)
 {
-	// Store variant description
-	append(v_rd_chrom, desc.chrom);
-	append(v_rd_pos, desc.pos - prev_pos);
-	prev_pos = desc.pos;
-	append(v_rd_id, desc.id);
-	append(v_rd_ref, desc.ref);
-	append(v_rd_alt, desc.alt);
-	append(v_rd_qual, desc.qual);
-	append(v_rd_filter, desc.filter);
-	append(v_rd_info, desc.info);
-
-	// Store genotypes
-	v_rd_gt.resize(no_samples * ploidy);
+	const uint8_t *checkpoint, *stream;
+	size_t stream_size;
 
-	if (ploidy == 1)
-		for (uint32_t i = 0; i < no_samples; ++i)
-			v_rd_gt[i] = (data[i] & 0b00000011);
-	else if(ploidy == 2)
-		for (uint32_t i = 0; i < no_samples; ++i)
-		{
-			v_rd_gt[2 * i + 0] = (data[i] & 0b00000011);
-			v_rd_gt[2 * i + 1] = ((data[i] >> 2) & 0b00000011);
-		}
+	if (open_mode != open_mode_t::reading || block_id >= v_blocks.size() || !get_block_gt(block_id, checkpoint, stream, stream_size))
+		return false;
 
-	pbwt.Encode(v_rd_gt, v_rle_gt_large);
-	ctx_prefix = context_prefix_mask;
-	ctx_symbol = context_symbol_mask;
+	reader.pbwt.StartReverse(no_samples * ploidy, neglect_limit);
+	decode_checkpoint(checkpoint, reader.v_perm);
+	reader.pbwt.SetPermutation(reader.v_perm);
 
-	v_rle_gt_large.back().second = 0u;
+	reader.coder.StartDecoding(stream, stream_size);
 
-	for (auto x : v_rle_gt_large)
-		encode_run_len(x.first, x.second);
+	start_desc_columns(block_id, reader.desc, 1);
 
-	++no_variants;
+	reader.no_variants_left = v_blocks[block_id].no_variants;
 
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::GetVariantGenotypesRaw(vector<pair<uint8_t, uint32_t>> &rle_genotypes)
+// Decode the next variant of the block; returns false at the end of the block or at corrupted data (see CBlockReader::Failed)
+bool CCompressedFile::ReadBlockVariant(CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data)
 {
-	if (i_variant >= no_variants)
+	if (reader.no_variants_left == 0)
 		return false;
 
-	rle_genotypes.clear();
-
-	uint32_t total_len = 0;
-	ctx_prefix = context_prefix_mask;
-	ctx_symbol = context_symbol_mask;
-
-	while (total_len < no_samples * ploidy)
-	{
-		uint8_t symbol;
-		uint32_t len;
-
-		decode_run_len(symbol, len);
-		if (len == 0)
-			len = no_samples * ploidy - total_len;
-		
-		rle_genotypes.push_back(make_pair(symbol, len));
+	if (!read_desc(reader.desc, desc))
+		return false;
 
-		total_len += len;
-	}
+	if (!reader.coder.DecodeRow(no_samples * ploidy, reader.v_rle))
+		return false;
+	reader.pbwt.Decode(reader.v_rle, reader.v_gt);
+	make_sample_data(reader.v_gt, data);
 
-	++i_variant;
+	--reader.no_variants_left;
 
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::GetVariantGenotypesRawAndDesc(variant_desc_t &desc, vector<pair<uint8_t, uint32_t>> &rle_genotypes)
+// Read run-length encoded row of the variant without reversing the PBWT
+bool CCompressedFile::ReadBlockVariantRaw(CBlockReader &reader, variant_desc_view_t &desc, vector<pair<uint8_t, uint32_t>> &rle_genotypes)
 {
-	desc.chrom.clear();
+	if (reader.no_variants_left == 0)
+		return false;
 
-	if (i_variant >= no_variants)
+	if (!read_desc(reader.desc, desc))
 		return false;
 
-	rle_genotypes.clear();
+	if (!reader.coder.DecodeRow(no_samples * ploidy, rle_genotypes))
+		return false;
 
-	int64_t pos;
+	--reader.no_variants_left;
 
-	// Load variant description
-	read(v_rd_chrom, p_chrom, desc.chrom);
-	read(v_rd_pos, p_pos, pos);
-	pos += prev_pos;
-	prev_pos = pos;
-	desc.pos = pos;
+	return true;
+}
 
-	read(v_rd_id, p_id, desc.id);
-	read(v_rd_ref, p_ref, desc.ref);
-	read(v_rd_alt, p_alt, desc.alt);
-	read(v_rd_qual, p_qual, desc.qual);
-	read(v_rd_filter, p_filter, desc.filter);
-	read(v_rd_info, p_info, desc.info);
+// ************************************************************************************
+// Prepare tracking of the items (haplotypes) in the block; only their ranks are read from the checkpoint
+bool CCompressedFile::StartBlockTracking(uint32_t block_id, const vector<uint32_t> &v_items, CBlockReader &reader)
+{
+	const uint8_t *checkpoint, *stream;
+	size_t stream_size;
 
-	uint32_t total_len = 0;
-	ctx_prefix = context_prefix_mask;
-	ctx_symbol = context_symbol_mask;
+	if (open_mode != open_mode_t::reading || block_id >= v_blocks.size() || !get_block_gt(block_id, checkpoint, stream, stream_size))
+		return false;
 
-	while (total_len < no_samples * ploidy)
-	{
-		uint8_t symbol;
-		uint32_t len;
+	uint32_t no_items = no_samples * ploidy;
+	uint32_t width = (uint32_t) no_bytes(no_items - 1);
 
-		decode_run_len(symbol, len);
-		if (len == 0)
-			len = no_samples * ploidy - total_len;
+	reader.v_items_pos.resize(v_items.size());
 
-		rle_genotypes.push_back(make_pair(symbol, len));
+	for (size_t i = 0; i < v_items.size(); ++i)
+	{
+		if (v_items[i] >= no_items)
+			return false;
 
-		total_len += len;
+		auto p = checkpoint + v_items[i] * width;
+		reader.v_items_pos[i] = 0;
+		for (uint32_t j = 0; j < width; ++j)
+			reader.v_items_pos[i] += ((uint32_t) p[j]) << (8 * j);
 	}
 
-	++i_variant;
+	reader.v_items_order.resize(v_items.size());
+	iota(reader.v_items_order.begin(), reader.v_items_order.end(), 0u);
+	sort(reader.v_items_order.begin(), reader.v_items_order.end(), [&](uint32_t x, uint32_t y) {
+		return reader.v_items_pos[x] < reader.v_items_pos[y]; });
+
+	reader.pbwt.StartReverse(no_items, neglect_limit);
+	reader.coder.StartDecoding(stream, stream_size);
+
+	start_desc_columns(block_id, reader.desc, 1);
+
+	reader.no_variants_left = v_blocks[block_id].no_variants;
 
 	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::InitPBWT()
+// Decode the next variant of the block and values of the tracked items; returns false at the end of the block
+bool CCompressedFile::ReadBlockVariantTracked(CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &v_values)
 {
-	if (open_mode == open_mode_t::reading)
-	{
-		pbwt.StartReverse(no_samples * ploidy, neglect_limit);
-		pbwt_initialised = true;
-	}
-	else if(open_mode == open_mode_t::writing)
-	{
-		pbwt.StartForward(no_samples * ploidy, neglect_limit);
-		pbwt_initialised = true;
+	if (reader.no_variants_left == 0)
+		return false;
 
-		v_rd_gt.reserve(no_samples * ploidy);
-	}
+	if (!read_desc(reader.desc, desc))
+		return false;
 
-	return pbwt_initialised;
-}
+	if (!reader.coder.DecodeRow(no_samples * ploidy, reader.v_rle))
+		return false;
+	reader.pbwt.TrackItems(reader.v_rle, reader.v_items_pos, reader.v_items_order, v_values);
 
-// ************************************************************************************
-bool CCompressedFile::TrackItem(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, 
-	uint8_t &value, uint32_t &item_new_pos)
-{
-	return pbwt.TrackItem(v_rle, item_prev_pos, value, item_new_pos);
+	--reader.no_variants_left;
+
+	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, array<uint32_t, 2> item_prev_pos, 
-	array<uint8_t, 2> &value, array<uint32_t, 2> &item_new_pos)
+// Start reading of descriptions of variants of the block only (genotypes are not loaded)
+bool CCompressedFile::StartBlockDescReading(uint32_t block_id, CBlockReader &reader)
 {
-	return pbwt.TrackItems(v_rle, item_prev_pos, value, item_new_pos);
+	if (open_mode != open_mode_t::reading || block_id >= v_blocks.size())
+		return false;
+
+	start_desc_columns(block_id, reader.desc, 1);
+
+	reader.no_variants_left = v_blocks[block_id].no_variants;
+
+	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, 
-	uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos)
+bool CCompressedFile::ReadBlockVariantDesc(CBlockReader &reader, variant_desc_view_t &desc)
 {
-	return pbwt.EstimateValue(v_rle, item_prev_pos, value, runs, item_new_pos);
+	if (reader.no_variants_left == 0)
+		return false;
+
+	if (!read_desc(reader.desc, desc))
+		return false;
+
+	--reader.no_variants_left;
+
+	return true;
 }
 
 // ************************************************************************************
-bool CCompressedFile::RevertDecode(uint32_t &pos_sample_to_trace, const vector<pair<uint8_t, uint32_t>> &hist_rle_genotypes, const uint8_t reference_value)
+bool CCompressedFile::Eof()
 {
-	return pbwt.RevertDecode(pos_sample_to_trace, hist_rle_genotypes, reference_value);
+	if (open_mode == open_mode_t::reading)
+	{
+		return i_variant >= no_variants;
+	}
+
+	return false;
 }
 
 // ************************************************************************************
-CCompressedFile::ctx_map_e_t::value_type CCompressedFile::find_rce_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter)
+// Read description of the next variant without decoding genotypes (should not be mixed with the other Get* calls)
+bool CCompressedFile::GetVariantDesc(variant_desc_t &desc)
 {
-	auto p = rce_coders.find(ctx);
+	desc.chrom.clear();
+
+	if (i_variant >= no_variants)
+		return false;
+
+	if (i_block < v_blocks.size() && i_variant == v_blocks[i_block].first_variant)
+	{
+		start_desc_columns(i_block, desc_cur, no_threads);
+		++i_block;
+	}
+
+	if (!read_desc(desc_cur, desc))
+		return false;
 
-	if (p == nullptr)
-		rce_coders.insert(ctx, p = new CRangeCoderModel<COutFile>(rce, no_symbols, max_log_counter, 1 << max_log_counter, nullptr, 1, true));
+	++i_variant;
 
-	return p;
+	return true;
 }
 
 // ************************************************************************************
-CCompressedFile::ctx_map_d_t::value_type CCompressedFile::find_rcd_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter)
+bool CCompressedFile::SetVariant(variant_desc_t &desc, vector<uint8_t> &data)
 {
-	auto p = rcd_coders.find(ctx);
+	if (no_variants % no_variants_in_block == 0)
+	{
+		if (no_variants)
+			end_block();
+		start_block(desc);
+	}
+
+	// Store variant description
+	append_desc(gt_cur->desc, desc);
+
+	// Store genotypes (items of non-zero values are collected only up to the neglect limit, as only rare rows use them)
+	v_rd_gt.resize(no_samples * ploidy);
+	v_rd_nonzero.clear();
+
+	if (ploidy == 1)
+		for (uint32_t i = 0; i < no_samples; ++i)
+		{
+			v_rd_gt[i] = (data[i] & 0b00000011);
+			if (v_rd_gt[i] && v_rd_nonzero.size() < neglect_limit)
+				v_rd_nonzero.push_back(i);
+		}
+	else if(ploidy == 2)
+		for (uint32_t i = 0; i < no_samples; ++i)
+		{
+			v_rd_gt[2 * i + 0] = (data[i] & 0b00000011);
+			v_rd_gt[2 * i + 1] = ((data[i] >> 2) & 0b00000011);
+			if ((data[i] & 0b00001111) && v_rd_nonzero.size() < neglect_limit)
+			{
+				if (v_rd_gt[2 * i + 0])
+					v_rd_nonzero.push_back(2 * i + 0);
+				if (v_rd_gt[2 * i + 1])
+					v_rd_nonzero.push_back(2 * i + 1);
+			}
+		}
 
-	if (p == nullptr)
-		rcd_coders.insert(ctx, p = new CRangeCoderModel<CInFile>(rcd, no_symbols, max_log_counter, 1 << max_log_counter, nullptr, 1, false));
+	if (gt_cur->no_rows == gt_cur->v_rows.size())
+		gt_cur->v_rows.emplace_back();
+	pbwt.Encode(v_rd_gt, v_rd_nonzero, gt_cur->v_rows[gt_cur->no_rows++]);
 
-	return p;
+	auto &b = v_blocks.back();
+	++b.no_variants;
+
+	if (b.v_contigs.empty() || b.v_contigs.back().chrom != desc.chrom)
+		b.v_contigs.push_back(contig_range_t{ desc.chrom, desc.pos, desc.pos });
+	else
+	{
+		auto &c = b.v_contigs.back();
+		c.min_pos = min(c.min_pos, desc.pos);
+		c.max_pos = max(c.max_pos, desc.pos);
+	}
+
+	++no_variants;
+
+	return true;
 }
 
 // ************************************************************************************
-void CCompressedFile::encode_run_len(uint8_t symbol, uint32_t len)
+bool CCompressedFile::GetVariantGenotypesRaw(vector<pair<uint8_t, uint32_t>> &rle_genotypes)
 {
-	// Encode symbol
-	auto rc_sym = find_rce_coder(ctx_symbol + context_symbol_flag, 4, 15);
-	rc_sym->Encode(symbol);
-	ctx_symbol <<= 4;
-	ctx_symbol += symbol;
-	ctx_symbol &= context_symbol_mask;
+	if (i_variant >= no_variants)
+		return false;
+
+	if (!prepare_variant(false))
+		return false;
 
-	rce_coders.prefetch(ctx_symbol + context_symbol_flag);
+	auto row = next_gt_row();
+	if (!row)
+		return false;
 
-	ctx_prefix <<= 4;
-	ctx_prefix += (context_t)symbol;
-	ctx_prefix &= context_prefix_mask;
+	// Buffers are exchanged, so the storage of the caller is recycled by the decoding task
+	rle_genotypes.swap(*row);
 
-	// Encode run length
-	auto rc_p = find_rce_coder(ctx_prefix + context_prefix_flag, 11, 10);
+	++i_variant;
 
-	uint32_t prefix = ilog2(len);
+	return true;
+}
 
-	ctx_prefix <<= 4;
-	ctx_prefix += (context_t)prefix;
-	ctx_prefix &= context_prefix_mask;
+// ************************************************************************************
+bool CCompressedFile::GetVariantGenotypesRawAndDesc(variant_desc_t &desc, vector<pair<uint8_t, uint32_t>> &rle_genotypes)
+{
+	desc.chrom.clear();
 
-	rce_coders.prefetch(ctx_prefix + context_prefix_flag);
+	if (i_variant >= no_variants)
+		return false;
 
-	if (prefix < 2)
-		rc_p->Encode(prefix);
-	else if (prefix < 10)
-	{
-		rc_p->Encode(prefix);
-		uint64_t ctx_suf = context_suffix_flag;
-		ctx_suf += ((context_t)symbol) << 8;
-		ctx_suf += (context_t) prefix;
-		uint32_t max_value_for_this_prefix = 1u << (prefix - 1);
+	if (!prepare_variant(true))
+		return false;
 
-		auto rc_s = find_rce_coder(ctx_suf, max_value_for_this_prefix, 15);
-		rc_s->Encode(len - max_value_for_this_prefix);
-	}
-	else
-	{
-		rc_p->Encode(10);		// flag for large value
+	// Load variant description
+	if (!next_gt_desc(desc))
+		return false;
 
-		context_t ctx_large1 = context_large_value1_flag;
-		ctx_large1 += ((context_t)symbol) << 16;
-		auto rc_l1 = find_rce_coder(ctx_large1, 256, 15);
-		uint32_t lv1 = (len >> 16) & 0xff;
-		rc_l1->Encode(lv1);
+	auto row = next_gt_row();
+	if (!row)
+		return false;
 
-		context_t ctx_large2 = context_large_value2_flag;
-		ctx_large2 += ((context_t)symbol) << 16;
-		ctx_large2 += (context_t) lv1;
-		auto rc_l2 = find_rce_coder(ctx_large2, 256, 15);
-		uint32_t lv2 = (len >> 8) & 0xff;
-		rc_l2->Encode(lv2);
+	// Buffers are exchanged, so the storage of the caller is recycled by the decoding task
+	rle_genotypes.swap(*row);
 
-		context_t ctx_large3 = context_large_value3_flag;
-		ctx_large3 += ((context_t)symbol) << 16;
-		ctx_large3 += ((context_t) lv1) << 8;
-		ctx_large3 += (context_t) lv2;
-		auto rc_l3 = find_rce_coder(ctx_large3, 256, 15);
-		uint32_t lv3 = len & 0xff;
-		rc_l3->Encode(lv3);
-	}
+	++i_variant;
+
+	return true;
 }
 
 // ************************************************************************************
-void CCompressedFile::decode_run_len(uint8_t &symbol, uint32_t &len)
+// Decode row and build its rank/select index
+bool CCompressedFile::GetVariantGenotypesRaw(CRLERow &row)
 {
-	// Decode symbol
-	auto rc_sym = find_rcd_coder(ctx_symbol + context_symbol_flag, 4, 15);
-	symbol = (uint8_t) rc_sym->Decode();
-	ctx_symbol <<= 4;
-	ctx_symbol += (context_t) symbol;
-	ctx_symbol &= context_symbol_mask;
+	if (!GetVariantGenotypesRaw(row.Runs()))
+		return false;
 
-	rcd_coders.prefetch(ctx_symbol + context_symbol_flag);
+	row.Build();
 
-	ctx_prefix <<= 4;
-	ctx_prefix += (context_t)symbol;
-	ctx_prefix &= context_prefix_mask;
+	return true;
+}
 
-	// Decode run length
-	auto rc_p = find_rcd_coder(ctx_prefix + context_prefix_flag, 11, 10);
+// ************************************************************************************
+bool CCompressedFile::GetVariantGenotypesRawAndDesc(variant_desc_t &desc, CRLERow &row)
+{
+	if (!GetVariantGenotypesRawAndDesc(desc, row.Runs()))
+		return false;
 
-	uint32_t prefix = rc_p->Decode();
+	row.Build();
 
-	if (prefix < 2)
-		len = prefix;
-	else if (prefix < 10)
-	{
-		uint64_t ctx_suf = context_suffix_flag;
-		ctx_suf += ((context_t)symbol) << 8;
-		ctx_suf += (context_t)prefix;
-		uint32_t max_value_for_this_prefix = 1u << (prefix - 1);
+	return true;
+}
 
-		auto rc_s = find_rcd_coder(ctx_suf, max_value_for_this_prefix, 15);
-		len = max_value_for_this_prefix + rc_s->Decode();
+// ************************************************************************************
+bool CCompressedFile::InitPBWT()
+{
+	if (open_mode == open_mode_t::reading)
+	{
+		pbwt.StartReverse(no_samples * ploidy, neglect_limit);
+		pbwt_initialised = true;
 	}
-	else
+	else if(open_mode == open_mode_t::writing)
 	{
-		context_t ctx_large1 = context_large_value1_flag;
-		ctx_large1 += ((context_t)symbol) << 16;
-		auto rc_l1 = find_rcd_coder(ctx_large1, 256, 15);
-		uint32_t lv1 = rc_l1->Decode();
-
-		context_t ctx_large2 = context_large_value2_flag;
-		ctx_large2 += ((context_t)symbol) << 16;
-		ctx_large2 += (context_t) lv1;
-		auto rc_l2 = find_rcd_coder(ctx_large2, 256, 15);
-		uint32_t lv2 = rc_l2->Decode();
-
-		context_t ctx_large3 = context_large_value3_flag;
-		ctx_large3 += ((context_t)symbol) << 16;
-		ctx_large3 += ((context_t) lv1) << 8;
-		ctx_large3 += (context_t) lv2;
-		auto rc_l3 = find_rcd_coder(ctx_large3, 256, 15);
-		uint32_t lv3 = rc_l3->Decode();
-
-		len = (lv1 << 16) + (lv2 << 8) + lv3;
+		pbwt.StartForward(no_samples * ploidy, neglect_limit);
+		pbwt_initialised = true;
 
-		prefix = ilog2(len);
+		v_rd_gt.reserve(no_samples * ploidy);
 	}
 
-	ctx_prefix <<= 4;
-	ctx_prefix += (context_t)prefix;
-	ctx_prefix &= context_prefix_mask;
+	return pbwt_initialised;
+}
 
-	rcd_coders.prefetch(ctx_prefix + context_prefix_flag);
+// ************************************************************************************
+bool CCompressedFile::EstimateValue(const CRLERow &row, uint32_t item_prev_pos, 
+	uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos)
+{
+	return pbwt.EstimateValue(row, item_prev_pos, value, runs, item_new_pos);
 }
 
 // EOF
@@ -10,25 +10,145 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include "vcf.h"
 #include "io.h"
 #include "pbwt.h"
 #include "rc.h"
 #include "sub_rc.h"
 #include <unordered_map>
-#include "context_hm.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "block_coder.h"
+#include "utils.h"
 
 using namespace std;
 
+// *******************************************************************************************
+// Typed description columns of a single block of variants
+enum desc_column_t {dc_chrom, dc_pos, dc_id, dc_id_num, dc_allele_len, dc_ref, dc_alt, dc_qual, dc_filter, dc_info, dc_no_columns};
+
+// Fields of variant descriptions that can be skipped when reading (CHROM and POS are always decoded)
+enum desc_field_t {df_id = 1, df_ref_alt = 2, df_qual = 4, df_filter = 8, df_info = 16, df_all = 31};
+
+// Decompressed columns are shared by descriptions viewing them, so each block gets new ones when it is read
+typedef array<vector<uint8_t>, dc_no_columns> desc_column_data_t;
+
+typedef struct {
+	shared_ptr<desc_column_data_t> columns;
+	array<size_t, dc_no_columns> v_pos;
+	int64_t prev_pos;
+
+	vector<string> v_contigs;						// contig dictionary of the block (writing only)
+	unordered_map<string, uint32_t> m_contigs;		// (writing only)
+	unordered_map<string, uint32_t> m_filters;		// FILTER dictionary of the block (writing only)
+	vector<text_view_t> v_contig_views;				// dictionaries viewed in the columns (reading only)
+	vector<text_view_t> v_filter_views;
+	uint32_t cur_contig;
+	uint32_t contig_run_len;						// writing: length of the current run, reading: no. of variants left in it
+
+	// Reading only: the chunk is loaded and its columns are decompressed at the first read of a description
+	uint32_t block_id;
+	bool loaded;
+	uint32_t no_threads;
+} desc_columns_t;
+
+// *******************************************************************************************
+// State of decoding of a single block of variants (blocks are independent, so many of them can be decoded in parallel)
+class CBlockReader
+{
+	friend class CCompressedFile;
+
+	CPBWT pbwt;
+	CBlockCoder coder;
+
+	vector<int> v_perm;
+	vector<pair<uint8_t, uint32_t>> v_rle;
+	vector<uint8_t> v_gt;
+	vector<uint32_t> v_items_pos;
+	vector<uint32_t> v_items_order;
+
+	desc_columns_t desc;
+	uint32_t no_variants_left;
+
+public:
+	// Description columns of the current block (descriptions read by the reader are views into them)
+	shared_ptr<const desc_column_data_t> DescColumns() const	{ return desc.columns; }
+
+	// Whether the last read stopped at corrupted data rather than at the end of the block (variants of the block are left)
+	bool Failed() const	{ return no_variants_left != 0; }
+};
+
+// *******************************************************************************************
 class CCompressedFile
 {
-	CInFile fi_db;
-	CInFile fi_gt;
+	CMappedFile fi_db;
+	CMappedFile fi_gt;
 	COutFile fo_db;
 	COutFile fo_gt;
 
-	CRangeEncoder<COutFile> *rce;
-	CRangeDecoder<CInFile> *rcd;
+	// Genotypes are stored in independently decodable blocks of variants.
+	// Each block starts with a checkpoint of the PBWT (ranks of haplotypes) followed by a range coded stream.
+	// Descriptions of variants of a block are stored as a chunk of LZMA compressed columns in the _db file.
+	// Archive characteristics, samples and the block index follow the chunks (their offset is in the last 8 bytes of _db).
+	typedef struct {
+		string chrom;
+		int64_t min_pos;
+		int64_t max_pos;
+	} contig_range_t;
+
+	typedef struct {
+		uint64_t gt_offset;
+		uint32_t first_variant;
+		uint32_t no_variants;
+		uint64_t db_offset;
+		uint64_t db_size;
+		vector<contig_range_t> v_contigs;
+	} block_desc_t;
+
+	vector<block_desc_t> v_blocks;
+	unordered_map<string, vector<pair<uint32_t, contig_range_t>>> m_contig_blocks;
+	uint32_t no_variants_in_block;
+	uint32_t i_block;
+	uint64_t gt_file_pos;
+	uint64_t db_file_pos;
+
+	vector<int> v_perm;
+
+	// PBWT rows and descriptions of a block waiting for compression (PBWT is sequential, range coding and LZMA are made by tasks in the thread pool).
+	// When reading, range decoding of rows is made by tasks for the current and the following blocks and the PBWT decoding consumes rows as they are published.
+	// Descriptions (if requested) are decoded by a separate task of the block and joined with the rows by the variant index.
+	typedef struct {
+		uint32_t block_id;
+		vector<uint8_t> v_checkpoint;
+		vector<vector<pair<uint8_t, uint32_t>>> v_rows;
+		uint32_t no_rows;
+		uint32_t no_rows_ready;
+		bool with_desc;
+		vector<variant_desc_t> v_descs;
+		uint32_t no_descs_ready;
+		uint32_t no_tasks_left;
+		bool cancelled;
+		vector<uint8_t> v_stream;
+		desc_columns_t desc;
+		vector<uint8_t> v_desc_chunk;
+		bool ready;
+	} gt_block_t;
+
+	const uint32_t no_gt_blocks_ahead = 2;
+	const uint32_t no_gt_rows_in_batch = 64;
+
+	uint32_t no_threads;
+	deque<gt_block_t*> q_gt_pending;
+	vector<gt_block_t*> v_gt_free;
+	gt_block_t *gt_cur;
+	uint32_t i_gt_row;
+	uint32_t no_gt_rows_avail;
+	uint32_t no_gt_descs_avail;
+	mutex mtx_gt;
+	condition_variable cv_gt;
 
 	CPBWT pbwt;
 	bool pbwt_initialised;
@@ -39,31 +159,18 @@ class CCompressedFile
 	vector<uint8_t> v_rd_meta, v_cd_meta;
 	vector<uint8_t> v_rd_samples, v_cd_samples;
 
-	vector<uint8_t> v_rd_chrom, v_cd_chrom;
-	vector<uint8_t> v_rd_pos, v_cd_pos;
-	vector<uint8_t> v_rd_id, v_cd_id;
-	vector<uint8_t> v_rd_ref, v_cd_ref;
-	vector<uint8_t> v_rd_alt, v_cd_alt;
-	vector<uint8_t> v_rd_qual, v_cd_qual;
-	vector<uint8_t> v_rd_filter, v_cd_filter;
-	vector<uint8_t> v_rd_info, v_cd_info;
+	vector<uint8_t> v_rd_blocks, v_cd_blocks;
+
+	desc_columns_t desc_cur;
+	uint32_t desc_fields;
 
 	vector<uint8_t> v_rd_gt;
-	vector<uint32_t> v_rle_gt;
-	vector<pair<uint8_t, uint32_t>> v_rle_gt_large;
+	vector<uint32_t> v_rd_nonzero;
 
 	size_t p_meta;
 	size_t p_header;
 	size_t p_samples;
-
-	size_t p_chrom;
-	size_t p_pos;
-	size_t p_id;
-	size_t p_ref;
-	size_t p_alt;
-	size_t p_qual;
-	size_t p_filter;
-	size_t p_info;
+	size_t p_blocks;
 
 	uint32_t no_variants;
 	uint32_t i_variant;
@@ -74,42 +181,51 @@ class CCompressedFile
 	string v_header;
 	vector<string> v_samples;
 
-	int64_t prev_pos;
-
-	const context_t context_symbol_flag = 1ull << 60;
-	const context_t context_symbol_mask = 0xffff;
-
-	const context_t context_prefix_mask = 0xfffff;
-	const context_t context_prefix_flag = 2ull << 60;
-	const context_t context_suffix_flag = 3ull << 60;
-	const context_t context_large_value1_flag = 4ull << 60;
-	const context_t context_large_value2_flag = 5ull << 60;
-	const context_t context_large_value3_flag = 6ull << 60;
-	
-	context_t ctx_prefix;
-	context_t ctx_symbol;
-	
-	typedef CContextHM<CRangeCoderModel<COutFile>> ctx_map_e_t;
-	typedef CContextHM<CRangeCoderModel<CInFile>> ctx_map_d_t;
-
-	ctx_map_e_t rce_coders;
-	ctx_map_d_t rcd_coders;
-
-	inline ctx_map_e_t::value_type find_rce_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter);
-	inline ctx_map_d_t::value_type find_rcd_coder(context_t ctx, uint32_t no_symbols, uint32_t max_log_counter);
-
-	inline void encode_run_len(uint8_t symbol, uint32_t len);
-	inline void decode_run_len(uint8_t &symbol, uint32_t &len);
-
-	void append(vector<uint8_t> &v_comp, string x);
+	void append(vector<uint8_t> &v_comp, const string &x);
 	void append(vector<uint8_t> &v_comp, int64_t x);
+	void append_varint(vector<uint8_t> &v_comp, uint64_t x);
 
 	void read(vector<uint8_t> &v_comp, size_t &pos, string &x);
 	void read(vector<uint8_t> &v_comp, size_t &pos, int64_t &x);
+	bool read(vector<uint8_t> &v_comp, size_t &pos, text_view_t &x);
+	uint64_t read_varint(vector<uint8_t> &v_comp, size_t &pos);
+	bool read_bytes(vector<uint8_t> &v_comp, size_t &pos, size_t len, text_view_t &x);
+
+	void append_desc(desc_columns_t &dc, const variant_desc_t &desc);
+	bool read_desc(desc_columns_t &dc, variant_desc_view_t &desc);
+	bool read_desc(desc_columns_t &dc, variant_desc_t &desc);
+	void format_ids(desc_column_data_t &v_data);
+	void flush_contig_run(desc_columns_t &dc);
+	void clear_desc_columns(desc_columns_t &dc);
+	void pack_desc_columns(desc_columns_t &dc, vector<uint8_t> &v_chunk);
+	bool unpack_desc_columns(desc_columns_t &dc);
+	void start_desc_columns(uint32_t block_id, desc_columns_t &dc, uint32_t _no_threads);
+	void make_sample_data(const vector<uint8_t> &v_gt, vector<uint8_t> &data);
+	void decode_checkpoint(const uint8_t *checkpoint, vector<int> &_v_perm);
+	bool get_block_gt(uint32_t block_id, const uint8_t *&checkpoint, const uint8_t *&stream, size_t &stream_size);
 
 	bool load_descriptions();
 	bool save_descriptions();
 
+	void store_block_index();
+	void load_block_index();
+
+	void start_block(const variant_desc_t &desc);
+	void end_block();
+	void write_blocks(bool flush_all);
+	void code_gt_block(gt_block_t *b);
+	void release_gt_blocks();
+	gt_block_t* get_gt_block();
+	void schedule_gt_blocks(uint32_t block_id, bool with_desc);
+	void decode_gt_block(gt_block_t *b, const uint8_t *stream, size_t stream_size);
+	void decode_desc_block(gt_block_t *b);
+	void finish_block_task(gt_block_t *b);
+	void retire_gt_block();
+	vector<pair<uint8_t, uint32_t>>* next_gt_row();
+	bool next_gt_desc(variant_desc_t &desc);
+	bool load_block(uint32_t block_id, bool with_desc);
+	bool prepare_variant(bool with_desc);
+
 public:
 	CCompressedFile();
 	~CCompressedFile();
@@ -137,21 +253,35 @@ public:
 	int GetNeglectLimit();
 	void SetNeglectLimit(uint32_t _neglect_limit);
 
+	void SetNoThreads(uint32_t _no_threads);
+	void SetDescFields(uint32_t _desc_fields);
+
+	uint32_t GetNoVariantsInBlock();
+	void SetNoVariantsInBlock(uint32_t _no_variants_in_block);
+	uint32_t GetNoBlocks();
+	uint32_t GetBlockFirstVariant(uint32_t block_id);
+	bool GetBlocksForRegions(const vector<region_t> &v_regions, vector<pair<uint32_t, uint32_t>> &v_block_ranges);
+	bool StartBlockReading(uint32_t block_id, CBlockReader &reader);
+	bool ReadBlockVariant(CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &data);
+	bool ReadBlockVariantRaw(CBlockReader &reader, variant_desc_view_t &desc, vector<pair<uint8_t, uint32_t>> &rle_genotypes);
+	bool StartBlockTracking(uint32_t block_id, const vector<uint32_t> &v_items, CBlockReader &reader);
+	bool ReadBlockVariantTracked(CBlockReader &reader, variant_desc_view_t &desc, vector<uint8_t> &v_values);
+	bool StartBlockDescReading(uint32_t block_id, CBlockReader &reader);
+	bool ReadBlockVariantDesc(CBlockReader &reader, variant_desc_view_t &desc);
+
 	bool Eof();
 
-	bool GetVariant(variant_desc_t &desc, vector<uint8_t> &data);
+	bool GetVariantDesc(variant_desc_t &desc);
 	bool SetVariant(variant_desc_t &desc, vector<uint8_t> &data);
 	bool GetVariantGenotypesRaw(vector<pair<uint8_t, uint32_t>> &rle_genotypes);
 	bool GetVariantGenotypesRawAndDesc(variant_desc_t &desc, vector<pair<uint8_t, uint32_t>> &rle_genotypes);
+	bool GetVariantGenotypesRaw(CRLERow &row);
+	bool GetVariantGenotypesRawAndDesc(variant_desc_t &desc, CRLERow &row);
 
 	bool InitPBWT();
 
-	bool TrackItem(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t &value, uint32_t &item_new_pos);
-	bool TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, array<uint32_t, 2> item_prev_pos, array<uint8_t, 2> &value, array<uint32_t, 2> &item_new_pos);
-
-	bool EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos);
 
-	bool RevertDecode(uint32_t &pos_sample_to_trace, const vector<pair<uint8_t, uint32_t>> &hist_rle_genotypes, const uint8_t reference_value);
+	bool EstimateValue(const CRLERow &row, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos);
 };
 
 // EOF
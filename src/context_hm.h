@@ -111,6 +111,20 @@ public:
 		return ht_memory;
 	}
 
+	// Remove all models (the allocated table is preserved for reuse)
+	void clear()
+	{
+		for (size_t i = 0; i < allocated; ++i)
+			if (data[i].rcm)
+			{
+				delete data[i].rcm;
+				data[i].rcm = nullptr;
+			}
+
+		size = 0;
+		filled = 0;
+	}
+
 	// Mozna to przyspieszyc tak, zebyinsert wykorzystywal wiedze o tym gdzie skonczyl szukac find
 	bool insert(context_t ctx, MODEL *rcm)
 	{
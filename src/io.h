@@ -15,6 +15,13 @@
 
 #include <iostream>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 #ifndef _WIN32
@@ -128,7 +135,6 @@ public:
 		return x;
 	}
 
-	// !!! To wygl¹da na b³¹d - brak sprawdzania 
 	void Read(uint8_t *ptr, uint64_t size)
 	{
 		if (before_buffer_bytes + buffer_pos + size > file_size)
@@ -136,11 +142,11 @@ public:
 
 		uint64_t to_read = size;
 
-		while (buffer_pos + to_read > BUFFER_SIZE)
+		while (buffer_pos + to_read > buffer_filled)
 		{
-			memcpy(ptr, buffer + buffer_pos, BUFFER_SIZE - buffer_pos);
-			ptr += BUFFER_SIZE - buffer_pos;
-			to_read -= BUFFER_SIZE - buffer_pos;
+			memcpy(ptr, buffer + buffer_pos, buffer_filled - buffer_pos);
+			ptr += buffer_filled - buffer_pos;
+			to_read -= buffer_filled - buffer_pos;
 
 			before_buffer_bytes += buffer_filled;
 			buffer_filled = fread(buffer, 1, BUFFER_SIZE, f);
@@ -168,16 +174,271 @@ public:
 	{
 		return before_buffer_bytes + buffer_pos;
 	}
+
+	bool Seek(size_t pos)
+	{
+		if (!f || pos > file_size)
+			return false;
+
+		if (pos >= before_buffer_bytes && pos < before_buffer_bytes + buffer_filled)
+		{
+			buffer_pos = pos - before_buffer_bytes;
+			return true;
+		}
+
+		if (my_fseek(f, pos, SEEK_SET) != 0)
+			return false;
+
+		before_buffer_bytes = pos;
+		buffer_pos = 0;
+		buffer_filled = 0;
+
+		return true;
+	}
+
+	// Random access read of a small part of file (the whole buffer is not refilled)
+	bool ReadAt(size_t pos, uint8_t *ptr, size_t size)
+	{
+		if (!f || pos + size > file_size)
+			return false;
+
+		if (pos >= before_buffer_bytes && pos + size <= before_buffer_bytes + buffer_filled)
+		{
+			memcpy(ptr, buffer + (pos - before_buffer_bytes), size);
+			buffer_pos = pos + size - before_buffer_bytes;
+			return true;
+		}
+
+		if (my_fseek(f, pos, SEEK_SET) != 0)
+			return false;
+
+		before_buffer_bytes = pos + size;
+		buffer_pos = 0;
+		buffer_filled = 0;
+
+		return fread(ptr, 1, size, f) == size;
+	}
+};
+
+// *******************************************************************************************
+// Memory mapped input file (read-only, so it can be accessed by many threads and shares the page cache among processes)
+// Under Windows the file is just read into memory
+class CMappedFile
+{
+	uint8_t *data;
+	size_t file_size;
+	size_t pos;
+
+#ifdef _WIN32
+	vector<uint8_t> v_data;
+#endif
+
+	// Data of empty files (they are not mapped)
+	static uint8_t* empty_data()
+	{
+		static uint8_t x = 0;
+		return &x;
+	}
+
+public:
+	enum class access_t {normal, sequential, random};
+
+	CMappedFile() : data(nullptr), file_size(0), pos(0)
+	{};
+
+	~CMappedFile()
+	{
+		Close();
+	}
+
+	bool Open(string file_name, access_t access = access_t::normal)
+	{
+		if (data)
+			return false;
+
+#ifndef _WIN32
+		int fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		file_size = (size_t) st.st_size;
+		pos = 0;
+
+		if (!file_size)
+		{
+			close(fd);
+			data = empty_data();
+			return true;
+		}
+
+		void *p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (p == MAP_FAILED)
+			return false;
+
+		data = (uint8_t *) p;
+
+		if (access == access_t::sequential)
+			madvise(data, file_size, MADV_SEQUENTIAL);
+		else if (access == access_t::random)
+			madvise(data, file_size, MADV_RANDOM);
+#else
+		FILE *f = fopen(file_name.c_str(), "rb");
+		if (!f)
+			return false;
+
+		my_fseek(f, 0, SEEK_END);
+		file_size = my_ftell(f);
+		my_fseek(f, 0, SEEK_SET);
+
+		v_data.resize(file_size);
+		bool ok = fread(v_data.data(), 1, file_size, f) == file_size;
+		fclose(f);
+
+		if (!ok)
+		{
+			v_data.clear();
+			return false;
+		}
+
+		data = file_size ? v_data.data() : empty_data();
+#endif
+		pos = 0;
+
+		return true;
+	}
+
+	bool Close()
+	{
+		if (!data)
+			return true;
+
+#ifndef _WIN32
+		if (data != empty_data())
+			munmap(data, file_size);
+#else
+		v_data.clear();
+		v_data.shrink_to_fit();
+#endif
+		data = nullptr;
+		file_size = 0;
+		pos = 0;
+
+		return true;
+	}
+
+	// Hint that the range of the file will be read soon
+	void WillNeed(size_t start, size_t size)
+	{
+#ifndef _WIN32
+		if (!data || start >= file_size)
+			return;
+
+		size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+		size_t aligned_start = start / page_size * page_size;
+
+		size = min(size, file_size - start) + (start - aligned_start);
+		madvise(data + aligned_start, size, MADV_WILLNEED);
+#endif
+	}
+
+	// Direct access to the contents of the file (valid until Close)
+	const uint8_t *Data(size_t start)
+	{
+		return data + start;
+	}
+
+	int Get()
+	{
+		if (pos < file_size)
+			return data[pos++];
+
+		return EOF;
+	}
+
+	uint8_t GetByte()
+	{
+		return (uint8_t)Get();
+	}
+
+	uint64_t ReadUInt(int no_bytes)
+	{
+		uint64_t x = 0;
+		uint64_t shift = 0;
+
+		for (int i = 0; i < no_bytes; ++i)
+		{
+			uint64_t c = Get();
+			x += c << shift;
+			shift += 8;
+		}
+
+		return x;
+	}
+
+	void Read(uint8_t *ptr, uint64_t size)
+	{
+		if (pos + size > file_size)
+			size = file_size - pos;
+
+		memcpy(ptr, data + pos, size);
+		pos += size;
+	}
+
+	bool Eof()
+	{
+		return pos >= file_size;
+	}
+
+	size_t FileSize()
+	{
+		return file_size;
+	}
+
+	size_t GetPos()
+	{
+		return pos;
+	}
+
+	bool Seek(size_t _pos)
+	{
+		if (!data || _pos > file_size)
+			return false;
+
+		pos = _pos;
+
+		return true;
+	}
+
+	// Random access read (does not change the current position, so it can be called concurrently)
+	bool ReadAt(size_t start, uint8_t *ptr, size_t size)
+	{
+		if (!data || start + size > file_size)
+			return false;
+
+		memcpy(ptr, data + start, size);
+
+		return true;
+	}
 };
 
 // *******************************************************************************************
 // Buffered output file
 class COutFile
 {
-	const size_t BUFFER_SIZE = 8 << 20;
+	const size_t DEFAULT_BUFFER_SIZE = 8 << 20;
 
 	FILE *f;
 	uint8_t *buffer;
+	size_t buffer_size;
 	size_t buffer_pos;
 	bool success;
 
@@ -193,7 +454,8 @@ public:
 			delete[] buffer;
 	}
 
-	bool Open(string file_name)
+	// Buffer size of 0 means the default one
+	bool Open(string file_name, size_t _buffer_size = 0)
 	{
 		if (f)
 			return false;
@@ -202,7 +464,8 @@ public:
 		if (!f)
 			return false;
 
-		buffer = new uint8_t[BUFFER_SIZE];
+		buffer_size = _buffer_size ? _buffer_size : DEFAULT_BUFFER_SIZE;
+		buffer = new uint8_t[buffer_size];
 		buffer_pos = 0;
 		success = true;
 
@@ -233,9 +496,9 @@ public:
 
 	void PutByte(uint8_t c)
 	{
-		if (buffer_pos == BUFFER_SIZE)
+		if (buffer_pos == buffer_size)
 		{
-			success &= fwrite(buffer, 1, BUFFER_SIZE, f) == BUFFER_SIZE;
+			success &= fwrite(buffer, 1, buffer_size, f) == buffer_size;
 			buffer_pos = 0;
 		}
 
@@ -244,9 +507,9 @@ public:
 
 	void Put(char c)
 	{
-		if (buffer_pos == BUFFER_SIZE)
+		if (buffer_pos == buffer_size)
 		{
-			success &= fwrite(buffer, 1, BUFFER_SIZE, f) == BUFFER_SIZE;
+			success &= fwrite(buffer, 1, buffer_size, f) == buffer_size;
 			buffer_pos = 0;
 		}
 
@@ -257,11 +520,11 @@ public:
 	{
 		uint8_t *q = (uint8_t *)p;
 
-		while (buffer_pos + n > BUFFER_SIZE)
+		while (buffer_pos + n > buffer_size)
 		{
-			size_t small_n = BUFFER_SIZE - buffer_pos;
+			size_t small_n = buffer_size - buffer_pos;
 			memcpy(buffer + buffer_pos, q, small_n);
-			success &= fwrite(buffer, 1, BUFFER_SIZE, f) == BUFFER_SIZE;
+			success &= fwrite(buffer, 1, buffer_size, f) == buffer_size;
 
 			buffer_pos = 0;
 			n -= small_n;
@@ -324,6 +587,20 @@ public:
 		v.push_back(x);
 	}
 
+	void Write(const uint8_t *p, size_t n)
+	{
+		v.insert(v.end(), p, p + n);
+	}
+
+	void WriteUInt(uint64_t x, int no_bytes)
+	{
+		for (int i = 0; i < no_bytes; ++i)
+		{
+			v.push_back(x & 0xffu);
+			x >>= 8;
+		}
+	}
+
 	size_t Size()
 	{
 		return v.size();
@@ -335,4 +612,91 @@ public:
 	}
 };
 
+// *******************************************************************************************
+// Read-only stream over external memory (e.g., a part of memory mapped file) for range decoders
+class CMemoryInStream
+{
+	const uint8_t *data;
+	size_t size;
+	size_t read_pos;
+	bool overrun;
+
+public:
+	CMemoryInStream() : data(nullptr), size(0), read_pos(0), overrun(false)
+	{}
+
+	void Attach(const uint8_t *_data, size_t _size)
+	{
+		data = _data;
+		size = _size;
+		read_pos = 0;
+		overrun = false;
+	}
+
+	void RestartRead()
+	{
+		read_pos = 0;
+		overrun = false;
+	}
+
+	bool Eof()
+	{
+		return read_pos >= size;
+	}
+
+	// Bytes past the end are read as 0 (a truncated stream is reported by Overrun)
+	uint8_t GetByte()
+	{
+		if (read_pos < size)
+			return data[read_pos++];
+
+		overrun = true;
+		return 0;
+	}
+
+	bool Overrun()
+	{
+		return overrun;
+	}
+
+	uint64_t ReadUInt(int no_bytes)
+	{
+		uint64_t x = 0;
+		uint64_t shift = 0;
+
+		for (int i = 0; i < no_bytes && read_pos < size; ++i)
+		{
+			uint64_t c = data[read_pos++];
+			x += c << shift;
+			shift += 8;
+		}
+
+		return x;
+	}
+
+	void Read(uint8_t *ptr, uint64_t n)
+	{
+		if (read_pos + n > size)
+			n = size - read_pos;
+
+		memcpy(ptr, data + read_pos, n);
+		read_pos += n;
+	}
+
+	const uint8_t *Data()
+	{
+		return data;
+	}
+
+	size_t Size()
+	{
+		return size;
+	}
+
+	size_t GetPos()
+	{
+		return read_pos;
+	}
+};
+
 // EOF
@@ -29,15 +29,23 @@ void CLZMAWrapper::Compress(const vector<uint8_t> &v_text, vector<uint8_t> &v_te
 }
 
 // *******************************************************************************************
-void CLZMAWrapper::Decompress(const vector<uint8_t> &v_text_compressed, vector<uint8_t> &v_text)
+bool CLZMAWrapper::Decompress(const vector<uint8_t> &v_text_compressed, vector<uint8_t> &v_text)
+{
+	return Decompress(v_text_compressed.data(), v_text_compressed.size(), v_text);
+}
+
+// *******************************************************************************************
+bool CLZMAWrapper::Decompress(const uint8_t *text_compressed, size_t size, vector<uint8_t> &v_text)
 {
 	lzma_stream strm = LZMA_STREAM_INIT;
 
 	bool success = init_decoder(&strm);
 	if (success)
-		success = decompress_impl(&strm, v_text_compressed, v_text);
+		success = decompress_impl(&strm, text_compressed, size, v_text);
 
 	lzma_end(&strm);
+
+	return success;
 }
 
 // *******************************************************************************************
@@ -180,11 +188,10 @@ bool CLZMAWrapper::init_decoder(lzma_stream *strm)
 
 // *******************************************************************************************
 // Do actual decompression
-bool CLZMAWrapper::decompress_impl(lzma_stream *strm, const vector<uint8_t> &v_in, vector<uint8_t> &v_out)
+bool CLZMAWrapper::decompress_impl(lzma_stream *strm, const uint8_t *in, size_t in_size, vector<uint8_t> &v_out)
 {
 	lzma_action action = LZMA_RUN;
 
-	uint8_t inbuf[BUFSIZ];
 	uint8_t outbuf[BUFSIZ];
 
 	strm->next_in = NULL;
@@ -193,14 +200,12 @@ bool CLZMAWrapper::decompress_impl(lzma_stream *strm, const vector<uint8_t> &v_i
 	strm->avail_out = sizeof(outbuf);
 
 	size_t in_pos = 0;
-	size_t in_size = v_in.size();
 
 	while (true) {
 		if (strm->avail_in == 0 && in_pos < in_size) {
-			strm->next_in = inbuf;
-
-			size_t to_read = std::min((size_t) sizeof(inbuf), in_size - in_pos);
-			copy_n(v_in.begin() + in_pos, to_read, inbuf);
+			// Input is in memory, so it is passed to the decoder directly
+			size_t to_read = std::min((size_t) BUFSIZ, in_size - in_pos);
+			strm->next_in = in + in_pos;
 			in_pos += to_read;
 			strm->avail_in = to_read;
 			
@@ -28,14 +28,15 @@ class CLZMAWrapper
 	static bool init_decoder(lzma_stream *strm);
 
 	static bool compress_impl(lzma_stream *strm, const vector<uint8_t> &v_in, vector<uint8_t> &v_out);
-	static bool decompress_impl(lzma_stream *strm, const vector<uint8_t> &v_in, vector<uint8_t> &v_out);
+	static bool decompress_impl(lzma_stream *strm, const uint8_t *in, size_t in_size, vector<uint8_t> &v_out);
 
 public:
 	CLZMAWrapper() {};
 	~CLZMAWrapper() {};
 
 	static void Compress(const vector<uint8_t> &v_text, vector<uint8_t> &v_text_compressed, int compression_mode = 0);
-	static void Decompress(const vector<uint8_t> &v_text_compressed, vector<uint8_t> &v_text);
+	static bool Decompress(const vector<uint8_t> &v_text_compressed, vector<uint8_t> &v_text);
+	static bool Decompress(const uint8_t *text_compressed, size_t size, vector<uint8_t> &v_text);
 
 	static void CompressWithHistory(const vector<uint8_t> &v_history, const vector<uint8_t> &v_text, vector<uint8_t> &v_text_compressed, int compression_mode = 0);
 	static void DecompressWithHistory(const vector<uint8_t> &v_history, const vector<uint8_t> &v_text_compressed, vector<uint8_t> &v_text, int compression_mode = 0);
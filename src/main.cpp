@@ -35,12 +35,17 @@ CApplication *app;
 int old_main(int argc, char **argv);
 
 bool parse_params(int argc, char **argv);
+bool parse_region(const string &str, region_t &region);
 void usage_main();
 void usage_compress_db();
 void usage_decompress_db();
 void usage_compress_sample();
+void usage_compress_samples();
 void usage_decompress_sample();
+void usage_decompress_samples();
 void usage_extract_sample();
+void usage_extract_samples();
+void usage_stats();
 
 // ******************************************************************************
 void usage_main()
@@ -51,8 +56,12 @@ void usage_main()
 	cerr << "    compress-db       - compress VCF file with collection of samples\n";
 	cerr << "    decompress-db     - decompress VCF file with collection of samples\n";
 	cerr << "    compress-sample   - compress VCF file containing a single sample\n";
+	cerr << "    compress-samples  - compress many samples in a single pass\n";
 	cerr << "    decompress-sample - decompress VCF file containing a single sample\n";
+	cerr << "    decompress-samples - decompress many samples in a single pass\n";
 	cerr << "    extract-sample    - extract a single sample from database\n";
+	cerr << "    extract-samples   - extract many samples from database in a single pass\n";
+	cerr << "    stats             - compute allele counts and frequencies of variants in database\n";
 }
 
 // ******************************************************************************
@@ -64,6 +73,8 @@ void usage_compress_db()
 	cerr << "  output_db - path to output database file\n";
 	cerr << "Options:\n";
     cerr << "  -nl <value> - ignore rare variants; value is a limit of alternative alleles (default: " << params.neglect_limit << ")\n";
+    cerr << "  -bs <value> - no. of variants in a block of genotypes (random access unit) (default: " << params.no_variants_in_block << ")\n";
+    cerr << "  -t <value>  - no. of threads compressing blocks of genotypes and descriptions (default: " << params.no_threads << ")\n";
 }
 
 // ******************************************************************************
@@ -76,6 +87,10 @@ void usage_decompress_db()
     cerr << "Options:\n";
     cerr << "  -b - output BCF file (VCF file by default)\n";
     cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\t"<< endl;
+    cerr << "  -r <region> - decompress only variants from region chrom[:start[-end]] (can be given many times)\n";
+    cerr << "  -t <value> - no. of threads decompressing blocks of genotypes and descriptions (default: " << params.no_threads << ")\n";
+    cerr << "  --drop-info - do not decode INFO fields (they are replaced by '.')\n";
+    cerr << "  --sites-only - output only descriptions of variants (genotypes are not decoded)\n";
 }
 
 // ******************************************************************************
@@ -89,6 +104,23 @@ void usage_compress_sample()
 	cerr << "Options:\n";
 	cerr << "  -sh               - store header of compressed_sample file\n";
 	cerr << "  -ev               - allow differnt variant sets in sample file and database\n";
+	cerr << "  -t <value>        - no. of threads (default: " << params.no_threads << ")\n";
+}
+
+// ******************************************************************************
+void usage_compress_samples()
+{
+	cerr << "gtshark compress-samples [options] <database> <input> <output>\n";
+	cerr << "Parameters:\n";
+	cerr << "  database   - path to database file obtained using `compress-db' command\n";
+	cerr << "  input      - path to input VCF (or VCF.GZ or BCF) file with samples to compress\n";
+	cerr << "  output     - path to existing directory for compressed samples (named after the samples) or sample container (with -C)\n";
+	cerr << "Options:\n";
+	cerr << "  -l         - input is a text file with paths of VCF (or VCF.GZ or BCF) files (one per line)\n";
+	cerr << "  -C         - append samples to a container (it is created if it does not exist)\n";
+	cerr << "  -sh        - store headers of compressed samples\n";
+	cerr << "  -ev        - allow different variant sets in sample files and database\n";
+	cerr << "  -t <value> - no. of threads compressing samples (default: " << params.no_threads << ")\n";
 }
 
 // ******************************************************************************
@@ -102,6 +134,24 @@ void usage_decompress_sample()
     cerr << "Options:\n";
     cerr << "  -b - output BCF file (VCF file by default)\n";
     cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\t"<< endl;
+	cerr << "  -t <value> - no. of threads (default: " << params.no_threads << ")\n";
+}
+
+// ******************************************************************************
+void usage_decompress_samples()
+{
+	cerr << "gtshark decompress-samples [options] <database> <input> <output>\n";
+	cerr << "Parameters:\n";
+	cerr << "  database     - path to database file obtained using `compress-db' command\n";
+	cerr << "  input        - path to text file with paths of compressed samples (one per line) or sample container (with -C)\n";
+	cerr << "  output       - path to existing directory for decompressed samples (named after the samples) or output VCF file (with -m)\n";
+	cerr << "Options:\n";
+	cerr << "  -C - input is a sample container\n";
+	cerr << "  -S <file> - file with names of samples to decompress from the container (one per line; all samples by default)\n";
+	cerr << "  -m - merge samples into a single VCF file (samples must be compressed without -ev)\n";
+	cerr << "  -b - output BCF files (VCF files by default)\n";
+	cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\n";
+	cerr << "  -t <value> - no. of threads decompressing samples (default: " << params.no_threads << ")\n";
 }
 
 // ******************************************************************************
@@ -115,6 +165,64 @@ void usage_extract_sample()
     cerr << "Options:\n";
     cerr << "  -b - output BCF file (VCF file by default)\n";
     cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\t"<< endl;
+    cerr << "  -r <region> - extract only variants from region chrom[:start[-end]] (can be given many times)\n";
+    cerr << "  -t <value> - no. of threads decompressing blocks of genotypes and descriptions (default: " << params.no_threads << ")\n";
+    cerr << "  --drop-info - do not decode INFO fields (they are replaced by '.')\n";
+}
+
+// ******************************************************************************
+void usage_extract_samples()
+{
+	cerr << "gtshark extract-samples [options] -S <samples_list> <database> <output_samples>\n";
+	cerr << "Parameters:\n";
+	cerr << "  database       - path to database file obtained using `compress-db' command\n";
+	cerr << "  output_samples - path to output VCF file containing the samples\n";
+    cerr << "Options:\n";
+    cerr << "  -S <file> - file with ids of samples to decompress (one per line)\n";
+    cerr << "  -b - output BCF file (VCF file by default)\n";
+    cerr << "  -c [0-9]   set level of compression of the output bcf (number from 0 to 9; 1 by default; 0 means no compression)\t"<< endl;
+    cerr << "  -r <region> - extract only variants from region chrom[:start[-end]] (can be given many times)\n";
+    cerr << "  -t <value> - no. of threads decompressing blocks of genotypes and descriptions (default: " << params.no_threads << ")\n";
+    cerr << "  --drop-info - do not decode INFO fields (they are replaced by '.')\n";
+}
+
+// ******************************************************************************
+void usage_stats()
+{
+	cerr << "gtshark stats [options] <database> <output_file>\n";
+	cerr << "Parameters:\n";
+	cerr << "  database    - path to database file obtained using `compress-db' command\n";
+	cerr << "  output_file - path to output text file with AC, AN, AF and missing rate of each variant\n";
+	cerr << "Options:\n";
+	cerr << "  -r <region> - process only variants from region chrom[:start[-end]] (can be given many times)\n";
+	cerr << "  -t <value> - no. of threads decompressing blocks of genotypes (default: " << params.no_threads << ")\n";
+}
+
+// ******************************************************************************
+// Parse region given as chrom, chrom:start or chrom:start-end
+bool parse_region(const string &str, region_t &region)
+{
+	region.chrom = str;
+	region.start = 1;
+	region.end = INT64_MAX;
+
+	auto p = str.find_last_of(':');
+	if (p == string::npos)
+		return !str.empty();
+
+	string range = str.substr(p + 1);
+	auto q = range.find('-');
+
+	if (range.empty() || range.find_first_not_of("0123456789-") != string::npos || q == 0)
+		return !str.empty();
+
+	region.chrom = str.substr(0, p);
+	region.start = atoll(range.substr(0, q).c_str());
+
+	if (q != string::npos && q + 1 < range.size())
+		region.end = atoll(range.substr(q + 1).c_str());
+
+	return !region.chrom.empty() && region.start <= region.end;
 }
 
 // ******************************************************************************
@@ -133,10 +241,18 @@ bool parse_params(int argc, char **argv)
 		params.work_mode = work_mode_t::decompress_db;
 	else if (string(argv[1]) == "compress-sample")
 		params.work_mode = work_mode_t::compress_sample;
+	else if (string(argv[1]) == "compress-samples")
+		params.work_mode = work_mode_t::compress_samples;
 	else if (string(argv[1]) == "decompress-sample")
 		params.work_mode = work_mode_t::decompress_sample;
+	else if (string(argv[1]) == "decompress-samples")
+		params.work_mode = work_mode_t::decompress_samples;
 	else if (string(argv[1]) == "extract-sample")
 		params.work_mode = work_mode_t::extract_sample;
+	else if (string(argv[1]) == "extract-samples")
+		params.work_mode = work_mode_t::extract_samples;
+	else if (string(argv[1]) == "stats")
+		params.work_mode = work_mode_t::stats;
 
 	// Compress-db
 	if (params.work_mode == work_mode_t::compress_db)
@@ -155,6 +271,32 @@ bool parse_params(int argc, char **argv)
 				params.neglect_limit = atoi(argv[i + 1]);
 				i += 2;
 			}
+			else if (string(argv[i]) == "-bs" && i + 1 < argc - 2)
+			{
+				params.no_variants_in_block = atoi(argv[i + 1]);
+				if (params.no_variants_in_block == 0)
+				{
+					usage_compress_db();
+					return false;
+				}
+				i += 2;
+			}
+			else if (string(argv[i]) == "-t" && i + 1 < argc - 2)
+			{
+				params.no_threads = atoi(argv[i + 1]);
+				if (params.no_threads == 0)
+				{
+					usage_compress_db();
+					return false;
+				}
+				i += 2;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_compress_db();
+				return false;
+			}
         }
 
 		params.vcf_file_name = string(argv[i]);
@@ -199,6 +341,40 @@ bool parse_params(int argc, char **argv)
                 }
                 i++;
             }
+            else if (string(argv[i]) == "-r")
+            {
+                region_t region;
+
+                i++;
+                if(i >= argc - 2 || !parse_region(argv[i], region))
+                {
+                    usage_decompress_db();
+                    return false;
+                }
+                params.v_regions.push_back(region);
+                i++;
+            }
+            else if (string(argv[i]) == "-t")
+            {
+                i++;
+                if(i >= argc - 2 || atoi(argv[i]) <= 0)
+                {
+                    usage_decompress_db();
+                    return false;
+                }
+                params.no_threads = atoi(argv[i]);
+                i++;
+            }
+            else if (string(argv[i]) == "--drop-info")
+            {
+                params.drop_info = true;
+                i++;
+            }
+            else if (string(argv[i]) == "--sites-only")
+            {
+                params.sites_only = true;
+                i++;
+            }
             else
             {
                 cerr << "Unknown option : " << argv[i] << endl;
@@ -232,6 +408,17 @@ bool parse_params(int argc, char **argv)
 				params.extra_variants = true;
 				++i;
 			}
+			else if (string(argv[i]) == "-t")
+			{
+				i++;
+				if (i >= argc - 3 || atoi(argv[i]) <= 0)
+				{
+					usage_compress_sample();
+					return false;
+				}
+				params.no_threads = atoi(argv[i]);
+				i++;
+			}
 			else
             {
                 cerr << "Unknown option : " << argv[i] << endl;
@@ -244,6 +431,60 @@ bool parse_params(int argc, char **argv)
 		params.vcf_file_name = string(argv[i+1]);
 		params.sample_file_name = string(argv[i+2]);
 	}
+	else if (params.work_mode == work_mode_t::compress_samples)
+	{
+		if (argc < 5)
+		{
+			usage_compress_samples();
+			return false;
+		}
+
+		int i = 2;
+		while (i < argc - 3)
+		{
+			if (string(argv[i]) == "-l")
+			{
+				params.input_vcf_list = true;
+				++i;
+			}
+			else if (string(argv[i]) == "-C")
+			{
+				params.sample_container = true;
+				++i;
+			}
+			else if (string(argv[i]) == "-sh")
+			{
+				params.store_sample_header = true;
+				++i;
+			}
+			else if (string(argv[i]) == "-ev")
+			{
+				params.extra_variants = true;
+				++i;
+			}
+			else if (string(argv[i]) == "-t")
+			{
+				i++;
+				if (i >= argc - 3 || atoi(argv[i]) <= 0)
+				{
+					usage_compress_samples();
+					return false;
+				}
+				params.no_threads = atoi(argv[i]);
+				i++;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_compress_samples();
+				return false;
+			}
+		}
+
+		params.db_file_name = string(argv[i]);
+		params.vcf_file_name = string(argv[i+1]);
+		params.sample_file_name = string(argv[i+2]);
+	}
 	else if (params.work_mode == work_mode_t::decompress_sample)
 	{
 		if (argc < 5)
@@ -283,6 +524,17 @@ bool parse_params(int argc, char **argv)
                 }
                 i++;
             }
+            else if (string(argv[i]) == "-t")
+            {
+                i++;
+                if (i >= argc - 3 || atoi(argv[i]) <= 0)
+                {
+                    usage_decompress_sample();
+                    return false;
+                }
+                params.no_threads = atoi(argv[i]);
+                i++;
+            }
             else
             {
                 cerr << "Unknown option : " << argv[i] << endl;
@@ -295,6 +547,87 @@ bool parse_params(int argc, char **argv)
 		params.sample_file_name = string(argv[i+1]);
 		params.vcf_file_name = string(argv[i+2]);
 	}
+	else if (params.work_mode == work_mode_t::decompress_samples)
+	{
+		if (argc < 5)
+		{
+			usage_decompress_samples();
+			return false;
+		}
+
+		int i = 2;
+		while (i < argc - 3)
+		{
+			if (string(argv[i]) == "-m")
+			{
+				params.merge_samples = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-C")
+			{
+				params.sample_container = true;
+				i++;
+			}
+			else if (string(argv[i]) == "-S")
+			{
+				i++;
+				if (i >= argc - 3)
+				{
+					usage_decompress_samples();
+					return false;
+				}
+				params.sample_list_file_name = string(argv[i]);
+				i++;
+			}
+			else if (string(argv[i]) == "-b")
+			{
+				params.out_type = file_type::BCF;
+				i++;
+			}
+			else if (string(argv[i]) == "-c")
+			{
+				i++;
+				if (i >= argc - 3 || atoi(argv[i]) < 0 || atoi(argv[i]) > 9)
+				{
+					usage_decompress_samples();
+					return false;
+				}
+				params.bcf_compression_level = atoi(argv[i]) ? argv[i][0] : 'u';
+				i++;
+			}
+			else if (string(argv[i]) == "-t")
+			{
+				i++;
+				if (i >= argc - 3 || atoi(argv[i]) <= 0)
+				{
+					usage_decompress_samples();
+					return false;
+				}
+				params.no_threads = atoi(argv[i]);
+				i++;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_decompress_samples();
+				return false;
+			}
+		}
+
+		if (!params.sample_container && !params.sample_list_file_name.empty())
+		{
+			cerr << "Option -S can be used only with -C\n";
+			usage_decompress_samples();
+			return false;
+		}
+
+		params.db_file_name = string(argv[i]);
+		if (params.sample_container)
+			params.sample_file_name = string(argv[i+1]);
+		else
+			params.sample_list_file_name = string(argv[i+1]);
+		params.vcf_file_name = string(argv[i+2]);
+	}
 	else if (params.work_mode == work_mode_t::extract_sample)
 	{
 		if (argc < 5)
@@ -333,6 +666,35 @@ bool parse_params(int argc, char **argv)
                 }
                 i++;
             }
+            else if (string(argv[i]) == "-r")
+            {
+                region_t region;
+
+                i++;
+                if(i >= argc - 3 || !parse_region(argv[i], region))
+                {
+                    usage_extract_sample();
+                    return false;
+                }
+                params.v_regions.push_back(region);
+                i++;
+            }
+            else if (string(argv[i]) == "-t")
+            {
+                i++;
+                if(i >= argc - 3 || atoi(argv[i]) <= 0)
+                {
+                    usage_extract_sample();
+                    return false;
+                }
+                params.no_threads = atoi(argv[i]);
+                i++;
+            }
+            else if (string(argv[i]) == "--drop-info")
+            {
+                params.drop_info = true;
+                i++;
+            }
             else
             {
                 cerr << "Unknown option : " << argv[i] << endl;
@@ -345,6 +707,147 @@ bool parse_params(int argc, char **argv)
 		params.id_sample = string(argv[i+1]);
 		params.vcf_file_name = string(argv[i+2]);
 	}
+	else if (params.work_mode == work_mode_t::extract_samples)
+	{
+		if (argc < 6)
+		{
+			usage_extract_samples();
+			return false;
+		}
+        int i = 2;
+        while (i < argc - 2)
+        {
+            if (string(argv[i]) == "-S")
+            {
+                i++;
+                if(i >= argc - 2)
+                {
+                    usage_extract_samples();
+                    return false;
+                }
+                params.sample_list_file_name = string(argv[i]);
+                i++;
+            }
+            else if (string(argv[i]) == "-b")
+            {
+                params.out_type = file_type::BCF;
+                i ++;
+            }
+            else if (string(argv[i]) == "-c")
+            {
+                i++;
+                if(i >= argc - 2)
+                {
+                    usage_extract_samples();
+                    return false;
+                }
+                int tmp = atoi(argv[i]);
+                if(tmp < 0 || tmp > 9)
+                {
+                    usage_extract_samples();
+                    return false;
+                }
+                else
+                {
+                    if(tmp)
+                        params.bcf_compression_level = argv[i][0];
+                    else
+                        params.bcf_compression_level = 'u';
+                }
+                i++;
+            }
+            else if (string(argv[i]) == "-r")
+            {
+                region_t region;
+
+                i++;
+                if(i >= argc - 2 || !parse_region(argv[i], region))
+                {
+                    usage_extract_samples();
+                    return false;
+                }
+                params.v_regions.push_back(region);
+                i++;
+            }
+            else if (string(argv[i]) == "-t")
+            {
+                i++;
+                if(i >= argc - 2 || atoi(argv[i]) <= 0)
+                {
+                    usage_extract_samples();
+                    return false;
+                }
+                params.no_threads = atoi(argv[i]);
+                i++;
+            }
+            else if (string(argv[i]) == "--drop-info")
+            {
+                params.drop_info = true;
+                i++;
+            }
+            else
+            {
+                cerr << "Unknown option : " << argv[i] << endl;
+                usage_extract_samples();
+                return false;
+            }
+        }
+
+		if (params.sample_list_file_name.empty())
+		{
+			usage_extract_samples();
+			return false;
+		}
+
+		params.db_file_name = string(argv[i]);
+		params.vcf_file_name = string(argv[i+1]);
+	}
+	else if (params.work_mode == work_mode_t::stats)
+	{
+		if (argc < 4)
+		{
+			usage_stats();
+			return false;
+		}
+
+		int i = 2;
+		while (i < argc - 2)
+		{
+			if (string(argv[i]) == "-r")
+			{
+				region_t region;
+
+				i++;
+				if (i >= argc - 2 || !parse_region(argv[i], region))
+				{
+					usage_stats();
+					return false;
+				}
+				params.v_regions.push_back(region);
+				i++;
+			}
+			else if (string(argv[i]) == "-t")
+			{
+				i++;
+				if (i >= argc - 2 || atoi(argv[i]) <= 0)
+				{
+					usage_stats();
+					return false;
+				}
+				params.no_threads = atoi(argv[i]);
+				i++;
+			}
+			else
+			{
+				cerr << "Unknown option : " << argv[i] << endl;
+				usage_stats();
+				return false;
+			}
+		}
+
+		params.db_file_name = string(argv[i]);
+		params.vcf_file_name = string(argv[i+1]);
+	}
 	else
 	{
 		cerr << "Unknown mode : " << argv[2] << endl;
@@ -374,10 +877,18 @@ int main(int argc, char **argv)
 		result = app->DecompressDB();
 	else if (params.work_mode == work_mode_t::extract_sample)
 		result = app->ExtractSample();
+	else if (params.work_mode == work_mode_t::extract_samples)
+		result = app->ExtractSamples();
 	else if (params.work_mode == work_mode_t::compress_sample)
 		result = app->CompressSample();
+	else if (params.work_mode == work_mode_t::compress_samples)
+		result = app->CompressSamples();
 	else if (params.work_mode == work_mode_t::decompress_sample)
 		result = app->DecompressSample();
+	else if (params.work_mode == work_mode_t::decompress_samples)
+		result = app->DecompressSamples();
+	else if (params.work_mode == work_mode_t::stats)
+		result = app->Stats();
 
 	delete app;
 
@@ -392,7 +903,7 @@ int main(int argc, char **argv)
 
 	fflush(stdout);
 
-	return 0;
+	return result ? 0 : 1;
 }
 
 // EOF
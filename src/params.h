@@ -10,12 +10,21 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 
 using namespace std;
 
-enum class work_mode_t {none, compress_db, decompress_db, compress_sample, decompress_sample, extract_sample};
+enum class work_mode_t {none, compress_db, decompress_db, compress_sample, compress_samples, decompress_sample, decompress_samples, extract_sample, extract_samples, stats};
 enum class file_type {VCF, BCF};
 
+// Genomic region (1-based, inclusive)
+struct region_t
+{
+	string chrom;
+	int64_t start;
+	int64_t end;
+};
+
 struct CParams
 {
 	work_mode_t work_mode;
@@ -24,14 +33,22 @@ struct CParams
 	string db_file_name;
 	string sample_file_name;
 	string id_sample;
+	string sample_list_file_name;
 	bool store_sample_header;
+	bool input_vcf_list;
+	bool merge_samples;
+	bool sample_container;
     
     file_type out_type;
     char bcf_compression_level;
 	bool extra_variants;
+	bool drop_info;
+	bool sites_only;
+	vector<region_t> v_regions;
 
 	// internal params
 	uint32_t neglect_limit;
+	uint32_t no_variants_in_block;
 
 	uint32_t no_threads;
 
@@ -40,13 +57,19 @@ struct CParams
 		work_mode = work_mode_t::none;
 		no_threads = 1;
 		store_sample_header = false;
+		input_vcf_list = false;
+		merge_samples = false;
+		sample_container = false;
         
         out_type = file_type::VCF;
         bcf_compression_level = '1';
 		extra_variants = false;
+		drop_info = false;
+		sites_only = false;
 
 		// internal params
 		neglect_limit = 10;
+		no_variants_in_block = 1u << 16;
 	}
 
 	void store_params(vector<uint8_t> &v_params)
@@ -13,9 +13,113 @@
 #include <iterator>
 #include "utils.h"
 
+// ************************************************************************************
+// CRLERow
+// ************************************************************************************
+CRLERow::CRLERow()
+{
+	v_start.push_back(0);
+	a_hist.fill(0u);
+	max_count = 0;
+}
+
+// ************************************************************************************
+// Make index of runs (must be called after each modification of runs)
+void CRLERow::Build()
+{
+	array<uint32_t, SIGMA> a_counts;
+	uint32_t cur_pos = 0;
+
+	a_counts.fill(0u);
+	v_start.resize(v_runs.size() + 1);
+	v_sampled_counts.resize((v_runs.size() + rank_sampling - 1) / rank_sampling);
+
+	for (size_t i = 0; i < v_runs.size(); ++i)
+	{
+		if (i % rank_sampling == 0)
+			v_sampled_counts[i / rank_sampling] = a_counts;
+
+		v_start[i] = cur_pos;
+		cur_pos += v_runs[i].second;
+		a_counts[v_runs[i].first] += v_runs[i].second;
+	}
+	v_start.back() = cur_pos;
+
+	a_hist = a_counts;
+	cumulate_sums(a_hist, max_count);
+}
+
+// ************************************************************************************
+// Index of the run containing position pos (pos must be smaller than the row size)
+size_t CRLERow::FindRun(uint32_t pos) const
+{
+	return (size_t) (upper_bound(v_start.begin(), v_start.end(), pos) - v_start.begin()) - 1;
+}
+
+// ************************************************************************************
+// No. of occurrences of symbol at positions [0, pos)
+uint32_t CRLERow::Rank(uint8_t symbol, uint32_t pos) const
+{
+	if (pos >= Size())
+		return ((uint32_t) symbol + 1 < SIGMA ? a_hist[symbol + 1] : Size()) - a_hist[symbol];
+	if (pos == 0)
+		return 0;
+
+	size_t i_run = FindRun(pos);
+	size_t i = i_run - i_run % rank_sampling;
+	uint32_t r = v_sampled_counts[i / rank_sampling][symbol];
+
+	for (; i < i_run; ++i)
+		if (v_runs[i].first == symbol)
+			r += v_runs[i].second;
+
+	if (v_runs[i_run].first == symbol)
+		r += pos - v_start[i_run];
+
+	return r;
+}
+
+// ************************************************************************************
+// Position of the i-th (0-based) occurrence of symbol
+bool CRLERow::Select(uint8_t symbol, uint32_t i, uint32_t &pos) const
+{
+	if (i >= Rank(symbol, Size()))
+		return false;
+
+	// Last sample with no more than i occurrences of symbol before it
+	size_t lo = 0, hi = v_sampled_counts.size();
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (v_sampled_counts[mid][symbol] <= i)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	uint32_t r = v_sampled_counts[lo][symbol];
+	for (size_t j = lo * rank_sampling; j < v_runs.size(); ++j)
+		if (v_runs[j].first == symbol)
+		{
+			if (i < r + v_runs[j].second)
+			{
+				pos = v_start[j] + (i - r);
+				return true;
+			}
+			r += v_runs[j].second;
+		}
+
+	return false;
+}
+
+// ************************************************************************************
+// CPBWT
 // ************************************************************************************
 CPBWT::CPBWT()
 {
+	rank_valid = false;
+	output_sparse = false;
+	sparse_output_data = nullptr;
 }
 
 // ************************************************************************************
@@ -34,6 +138,8 @@ bool CPBWT::StartForward(const size_t _no_items, const size_t _neglect_limit)
 
 	iota(v_perm_cur.begin(), v_perm_cur.end(), 0);
 	v_perm_prev = v_perm_cur;
+
+	rank_valid = false;
 	
 	return true;
 }
@@ -52,6 +158,30 @@ bool CPBWT::StartReverse(const size_t _no_items, const size_t _neglect_limit)
 	v_tmp.clear();
 	v_tmp.resize(no_items, 0u);
 
+	output_sparse = false;
+	sparse_output_data = nullptr;
+
+	return true;
+}
+
+// ************************************************************************************
+// Current permutation of items (used as a checkpoint at block boundaries)
+bool CPBWT::GetPermutation(vector<int> &v_perm)
+{
+	v_perm = v_perm_prev;
+
+	return true;
+}
+
+// ************************************************************************************
+bool CPBWT::SetPermutation(const vector<int> &v_perm)
+{
+	if (v_perm.size() != no_items)
+		return false;
+
+	v_perm_prev = v_perm;
+	rank_valid = false;
+
 	return true;
 }
 
@@ -93,11 +223,63 @@ bool CPBWT::Encode(vector<uint8_t> &v_input, vector<pair<uint8_t, uint32_t>> &v_
 
 	// Swap only if no. of non-zeros is larger than neglect_limit
 	if (no_items - max_count >= neglect_limit)
+	{
 		swap(v_perm_prev, v_perm_cur);
+		rank_valid = false;
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// Forward PBWT with a list of items of non-zero values (it is enough to give at most neglect_limit of them).
+// For rows with less than neglect_limit non-zeros the permutation is not changed, so only these items are processed.
+bool CPBWT::Encode(vector<uint8_t> &v_input, const vector<uint32_t> &v_nonzero, vector<pair<uint8_t, uint32_t>> &v_rle)
+{
+	if (v_nonzero.size() >= neglect_limit)
+		return Encode(v_input, v_rle);
+
+	encode_sparse(v_input, v_nonzero, v_rle);
 
 	return true;
 }
 
+// ************************************************************************************
+void CPBWT::encode_sparse(vector<uint8_t> &v_input, const vector<uint32_t> &v_nonzero, vector<pair<uint8_t, uint32_t>> &v_rle)
+{
+	if (!rank_valid)
+	{
+		v_rank.resize(no_items);
+		for (size_t i = 0; i < no_items; ++i)
+			v_rank[v_perm_prev[i]] = (uint32_t) i;
+		rank_valid = true;
+	}
+
+	v_sparse.clear();
+	for (auto x : v_nonzero)
+		v_sparse.push_back(make_pair(v_rank[x], v_input[x]));
+	sort(v_sparse.begin(), v_sparse.end());
+
+	v_rle.clear();
+
+	uint32_t cur_pos = 0;
+	for (auto &x : v_sparse)
+	{
+		if (x.first > cur_pos)
+			v_rle.push_back(make_pair((uint8_t) 0, x.first - cur_pos));
+
+		if (!v_rle.empty() && v_rle.back().first == x.second)
+			++v_rle.back().second;
+		else
+			v_rle.push_back(make_pair(x.second, 1u));
+
+		cur_pos = x.first + 1;
+	}
+
+	if (cur_pos < no_items)
+		v_rle.push_back(make_pair((uint8_t) 0, (uint32_t) (no_items - cur_pos)));
+}
+
 // ************************************************************************************
 // Reverse PBWT for non-binary alphabet
 bool CPBWT::Decode(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t> &v_output)
@@ -105,10 +287,19 @@ bool CPBWT::Decode(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t>
 	vector<uint32_t> v_hist(SIGMA);
 	uint32_t max_count;
 
-	v_output.resize(no_items);
-
 	calc_cumulate_histogram(v_rle, v_hist, max_count);
 
+	// Rows with less than neglect_limit items different than 0 do not change the permutation
+	if (no_items - max_count < neglect_limit && v_hist[1] - v_hist[0] == max_count)
+	{
+		decode_sparse(v_rle, v_output);
+		return true;
+	}
+
+	output_sparse = false;
+	sparse_output_data = nullptr;
+	v_output.resize(no_items);
+
 	auto p_rle = v_rle.begin();
 	uint8_t cur_symbol = p_rle->first;
 	uint32_t cur_cnt = p_rle->second;
@@ -137,88 +328,43 @@ bool CPBWT::Decode(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t>
 }
 
 // ************************************************************************************
-bool CPBWT::TrackItem(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t &value, uint32_t &item_new_pos)
+// Only the items of non-zero values are set if v_output is the vector given in the previous call of Decode
+void CPBWT::decode_sparse(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t> &v_output)
 {
-	// Determine histogram of symbols in run-encoded data
-	vector<uint32_t> v_hist_complete(SIGMA, 0u);
-	vector<uint32_t> v_hist_partial(SIGMA, 0u);
-	uint32_t max_count;
-
-	for (auto x : v_rle)
-		v_hist_complete[x.first] += x.second;
-
-	cumulate_sums(v_hist_complete, max_count);
-
-	int cur_pos = 0;
-	for (auto x : v_rle)
+	if (output_sparse && v_output.size() == no_items && v_output.data() == sparse_output_data)
 	{
-		if (item_prev_pos < cur_pos + x.second)
-		{
-			value = x.first;
-			v_hist_partial[x.first] += item_prev_pos - cur_pos;
-			break;
-		}
-		else
-			v_hist_partial[x.first] += x.second;
-
-		cur_pos += x.second;
+		for (auto x : v_output_nonzero)
+			v_output[x] = 0;
 	}
-
-	// Swap only if no. of non-zeros is larger than neglect_limit
-	if (no_items - max_count >= neglect_limit)
-		item_new_pos = v_hist_complete[value] + v_hist_partial[value];
 	else
-		item_new_pos = item_prev_pos;
-
-	return true;
-}
-
-// ************************************************************************************
-bool CPBWT::TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, array<uint32_t, 2> item_prev_pos, array<uint8_t, 2> &value, array<uint32_t, 2> &item_new_pos)
-{
-	// Determine histogram of symbols in run-encoded data
-	vector<uint32_t> v_hist_complete(SIGMA, 0u);
-	vector<uint32_t> v_hist_partial;
-	uint32_t max_count;
-
-	for (auto x : v_rle)
-		v_hist_complete[x.first] += x.second;
+	{
+		v_output.assign(no_items, 0);
+		output_sparse = true;
+		sparse_output_data = v_output.data();
+	}
 
-	cumulate_sums(v_hist_complete, max_count);
+	v_output_nonzero.clear();
 
-	for (uint32_t i = 0; i < 2; ++i)
+	uint32_t cur_pos = 0;
+	for (auto &x : v_rle)
 	{
-		int cur_pos = 0;
-		v_hist_partial.clear();
-		v_hist_partial.resize(SIGMA, 0u);
-
-		for (auto x : v_rle)
-		{
-			if (item_prev_pos[i] < cur_pos + x.second)
+		if (x.first != 0)
+			for (uint32_t i = cur_pos; i < cur_pos + x.second; ++i)
 			{
-				value[i] = x.first;
-				v_hist_partial[x.first] += item_prev_pos[i] - cur_pos;
-				break;
+				v_output[v_perm_prev[i]] = x.first;
+				v_output_nonzero.push_back(v_perm_prev[i]);
 			}
-			else
-				v_hist_partial[x.first] += x.second;
 
-			cur_pos += x.second;
-		}
-
-		// Swap only if no. of non-zeros is larger than neglect_limit
-		if (no_items - max_count >= neglect_limit)
-			item_new_pos[i] = v_hist_complete[value[i]] + v_hist_partial[value[i]];
-		else
-			item_new_pos[i] = item_prev_pos[i];
+		cur_pos += x.second;
 	}
-
-	return true;
 }
 
 // ************************************************************************************
-bool CPBWT::EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos)
+// Track many items in a single scan of runs; v_order contains indices of items sorted by their positions and is kept sorted
+bool CPBWT::TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint32_t> &v_item_pos, vector<uint32_t> &v_order, vector<uint8_t> &v_value)
 {
+	array<uint32_t, SIGMA> a_hist_partial;
+	array<uint32_t, SIGMA> a_hist_tracked;
 	uint32_t max_count;
 
 	if (v_hist_complete.size() != SIGMA)
@@ -234,49 +380,86 @@ bool CPBWT::EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t
 
 	cumulate_sums(v_hist_complete, max_count);
 
-	fill_n(runs.begin(), 2, make_pair(0u, 0u));
-	int cur_pos = 0;
-	uint32_t counter_for_value = 0;
+	// Swap only if no. of non-zeros is larger than neglect_limit
+	bool swapped = no_items - max_count >= neglect_limit;
 
-	if (item_prev_pos == 0)
+	v_value.resize(v_item_pos.size());
+	a_hist_partial.fill(0u);
+	a_hist_tracked.fill(0u);
+
+	auto p_rle = v_rle.begin();
+	uint32_t cur_pos = 0;
+
+	for (auto i : v_order)
 	{
-		runs[0] = make_pair(0u, 0u);
-		runs[1] = v_rle[0];
-	}
-	else
-		for (uint32_t i = 0; i < v_rle.size(); ++i)
+		uint32_t item_prev_pos = v_item_pos[i];
+
+		while (item_prev_pos >= cur_pos + p_rle->second)
 		{
-			if (item_prev_pos == cur_pos + v_rle[i].second)
-			{
-				runs[0] = v_rle[i];
-				if (i + 1 < v_rle.size())
-					runs[1] = v_rle[i+1];
+			a_hist_partial[p_rle->first] += p_rle->second;
+			cur_pos += p_rle->second;
+			++p_rle;
+		}
 
-				if(value == v_rle[i].first)
-					counter_for_value += v_rle[i].second;
+		uint8_t value = p_rle->first;
+		v_value[i] = value;
+		++a_hist_tracked[value];
 
-				break;
-			}
-			else if (item_prev_pos < cur_pos + v_rle[i].second)
-			{
-				runs[0].first = runs[1].first = v_rle[i].first;
-				runs[0].second = item_prev_pos - cur_pos;
-				runs[1].second = v_rle[i].second - runs[0].second;
-			
-				if (value == v_rle[i].first)
-					counter_for_value += runs[0].second;
-			
-				break;
-			}
+		if (swapped)
+			v_item_pos[i] = v_hist_complete[value] + a_hist_partial[value] + (item_prev_pos - cur_pos);
+	}
+
+	if (!swapped)
+		return true;
+
+	// New order of items: stable partition by values (as in the PBWT itself)
+	uint32_t sum = 0;
+	for (auto &x : a_hist_tracked)
+	{
+		uint32_t t = x;
+		x = sum;
+		sum += t;
+	}
+
+	v_order_tmp.resize(v_order.size());
+	for (auto i : v_order)
+		v_order_tmp[a_hist_tracked[v_value[i]]++] = i;
+	swap(v_order, v_order_tmp);
 
-			cur_pos += v_rle[i].second;
-			if (value == v_rle[i].first)
-				counter_for_value += v_rle[i].second;
+	return true;
+}
+
+// ************************************************************************************
+// Runs before and after the item and its new position
+bool CPBWT::EstimateValue(const CRLERow &row, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos)
+{
+	fill_n(runs.begin(), 2, make_pair(0u, 0u));
+
+	if (item_prev_pos == 0)
+		runs[1] = row.Run(0);
+	else if (item_prev_pos <= row.Size())
+	{
+		size_t i = row.FindRun(item_prev_pos - 1);
+		uint32_t run_start = row.RunStart(i);
+		auto &run = row.Run(i);
+
+		if (item_prev_pos == run_start + run.second)
+		{
+			runs[0] = run;
+			if (i + 1 < row.NoRuns())
+				runs[1] = row.Run(i + 1);
+		}
+		else
+		{
+			runs[0].first = runs[1].first = run.first;
+			runs[0].second = item_prev_pos - run_start;
+			runs[1].second = run.second - runs[0].second;
 		}
+	}
 
 	// Swap only if no. of non-zeros is larger than neglect_limit
-	if (no_items - max_count >= neglect_limit)
-		item_new_pos = v_hist_complete[value] + counter_for_value;
+	if (no_items - row.MaxCount() >= neglect_limit)
+		item_new_pos = row.HistCumulated(value) + row.Rank(value, item_prev_pos);
 	else
 		item_new_pos = item_prev_pos;
 
@@ -284,54 +467,152 @@ bool CPBWT::EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t
 }
 
 // ************************************************************************************
-bool CPBWT::RevertDecode(uint32_t &pos_sample_to_trace, const vector<pair<uint8_t, uint32_t>> &hist_rle_genotypes, const uint8_t reference_value)
+// CDivergenceArray
+// ************************************************************************************
+CDivergenceArray::CDivergenceArray(size_t no_items)
 {
-	array<uint32_t, SIGMA> a_hist;
-	uint32_t max_count;
+	v_start.resize(no_items, 0);
+	v_block_max.resize((no_items + block_size - 1) / block_size, 0);
+	v_super_block_max.resize((no_items + super_block_size - 1) / super_block_size, 0);
+}
 
-	fill_n(a_hist.begin(), SIGMA, 0u);
-	for (auto &x : hist_rle_genotypes)
-		a_hist[x.first] += x.second;
-	cumulate_sums(a_hist, max_count);
+// ************************************************************************************
+// Starts can only grow (unless the maxima are cleared and all positions are set again)
+void CDivergenceArray::set_start(uint32_t pos, uint32_t start)
+{
+	v_start[pos] = start;
+	v_block_max[pos / block_size] = max(v_block_max[pos / block_size], start);
+	v_super_block_max[pos / super_block_size] = max(v_super_block_max[pos / super_block_size], start);
+}
 
-	uint8_t value = SIGMA - 1;
+// ************************************************************************************
+// Maxima are built again by set_start (for all positions)
+void CDivergenceArray::clear_maxima()
+{
+	fill(v_block_max.begin(), v_block_max.end(), 0u);
+	fill(v_super_block_max.begin(), v_super_block_max.end(), 0u);
+}
 
-	for(uint32_t i = 1; i < SIGMA; ++i)
-		if (pos_sample_to_trace < a_hist[i])
-		{
-			value = (uint8_t) (i - 1);
-			break;
-		}
+// ************************************************************************************
+// Single positions are checked only at the ends of the range, the remaining part is covered by blocks and super blocks
+uint32_t CDivergenceArray::MaxStart(uint32_t from, uint32_t to) const
+{
+	uint32_t r = 0;
 
-	if (value != reference_value)
-		return false;
+	for (; from < to && from % block_size; ++from)
+		r = max(r, v_start[from]);
+	for (; from < to && to % block_size; --to)
+		r = max(r, v_start[to - 1]);
 
-	uint32_t new_pos_sample = a_hist[value];
+	for (; from < to && from % super_block_size; from += block_size)
+		r = max(r, v_block_max[from / block_size]);
+	for (; from < to && to % super_block_size; to -= block_size)
+		r = max(r, v_block_max[to / block_size - 1]);
 
-	uint32_t cur_pos = 0;
+	for (; from < to; from += super_block_size)
+		r = max(r, v_super_block_max[from / super_block_size]);
+
+	return r;
+}
+
+// ************************************************************************************
+// CPBWTDivergence
+// ************************************************************************************
+CPBWTDivergence::CPBWTDivergence(const size_t _no_items, const size_t _neglect_limit)
+{
+	no_items = _no_items;
+	neglect_limit = _neglect_limit;
+	no_rows = 0;
+
+	free_arrays = make_shared<free_arrays_t>();
+
+	// Before the first row all items match (with the empty match)
+	cur = get_array();
+}
+
+// ************************************************************************************
+// Recycled array (its contents are to be overwritten) or a new one
+shared_ptr<CDivergenceArray> CPBWTDivergence::get_array()
+{
+	CDivergenceArray *p = nullptr;
 
-	for (auto &x : hist_rle_genotypes)
 	{
-		if (x.first != value)
-			cur_pos += x.second;
-		else if (cur_pos + x.second < pos_sample_to_trace)
+		lock_guard<mutex> lck(free_arrays->mtx);
+		if (!free_arrays->v_arrays.empty())
 		{
-			cur_pos += x.second;
-			new_pos_sample += x.second;
+			p = free_arrays->v_arrays.back();
+			free_arrays->v_arrays.pop_back();
 		}
-		else
+	}
+
+	if (!p)
+		p = new CDivergenceArray(no_items);
+
+	auto fa = free_arrays;
+
+	return shared_ptr<CDivergenceArray>(p, [fa](CDivergenceArray *q) {
+		lock_guard<mutex> lck(fa->mtx);
+		fa->v_arrays.push_back(q);
+	});
+}
+
+// ************************************************************************************
+// Items of the same value in the row keep their order and the start of the match of an item with its new predecessor
+// is the max. start of matches between them in the previous order (Durbin's update made over runs of the row).
+// If items are not permuted, matches end only between runs.
+shared_ptr<const CDivergenceArray> CPBWTDivergence::Add(const CRLERow &row)
+{
+	uint32_t new_start = no_rows + 1;
+
+	++no_rows;
+
+	// Swap only if no. of non-zeros is larger than neglect_limit (as in the PBWT)
+	if (no_items - row.MaxCount() < neglect_limit)
+	{
+		for (size_t i = 1; i < row.NoRuns(); ++i)
+			if (row.Run(i).first != row.Run(i - 1).first)
+				cur->set_start(row.RunStart(i), new_start);
+
+		return nullptr;
+	}
+
+	shared_ptr<CDivergenceArray> prev = cur;
+	cur = get_array();
+	cur->clear_maxima();
+
+	const auto &v_src = prev->v_start;
+	auto &dst = *cur;
+	array<uint32_t, SIGMA> a_pos;
+	array<uint32_t, SIGMA> a_max;			// max. start of matches since the last item of each value
+
+	for (uint32_t i = 0; i < SIGMA; ++i)
+		a_pos[i] = row.HistCumulated((uint8_t) i);
+	a_max.fill(new_start);
+
+	uint32_t pos = 0;
+	for (size_t i = 0; i < row.NoRuns(); ++i)
+	{
+		uint8_t value = row.Run(i).first;
+		uint32_t len = row.Run(i).second;
+		uint32_t run_max = v_src[pos];
+
+		// Maxima of blocks are updated while copying
+		dst.set_start(a_pos[value], max(a_max[value], v_src[pos]));
+		for (uint32_t j = 1; j < len; ++j)
 		{
-			new_pos_sample += pos_sample_to_trace - cur_pos;
-			cur_pos += x.second;
+			dst.set_start(a_pos[value] + j, v_src[pos + j]);
+			run_max = max(run_max, v_src[pos + j]);
 		}
-		
-		if (cur_pos >= pos_sample_to_trace)
-			break;
-	}
 
-	pos_sample_to_trace = new_pos_sample;
+		for (auto &x : a_max)
+			x = max(x, run_max);
+		a_max[value] = 0;
 
-	return true;
+		a_pos[value] += len;
+		pos += len;
+	}
+
+	return prev;
 }
 
 // EOF
@@ -9,10 +9,45 @@
 // *******************************************************************************************
 
 #include <vector>
+#include <memory>
+#include <mutex>
 #include "defs.h"
 
 using namespace std;
 
+// *******************************************************************************************
+// Run-length encoded PBWT row indexed for rank/select queries.
+// Counts of symbols are sampled every rank_sampling runs, so a query is a binary search plus a scan of a few runs.
+class CRLERow
+{
+	static const uint32_t rank_sampling = 16;
+
+	vector<pair<uint8_t, uint32_t>> v_runs;
+	vector<uint32_t> v_start;							// start positions of runs (with the row size at the end)
+	vector<array<uint32_t, SIGMA>> v_sampled_counts;	// counts of symbols before runs 0, rank_sampling, 2 * rank_sampling, ...
+	array<uint32_t, SIGMA> a_hist;						// cumulated histogram of symbols
+	uint32_t max_count;
+
+public:
+	CRLERow();
+
+	vector<pair<uint8_t, uint32_t>> &Runs()			{ return v_runs; }
+	const vector<pair<uint8_t, uint32_t>> &Runs() const	{ return v_runs; }
+	void Build();
+
+	uint32_t Size() const						{ return v_start.back(); }
+	size_t NoRuns() const						{ return v_runs.size(); }
+	const pair<uint8_t, uint32_t> &Run(size_t i) const	{ return v_runs[i]; }
+	uint32_t RunStart(size_t i) const				{ return v_start[i]; }
+	uint32_t HistCumulated(uint8_t symbol) const	{ return a_hist[symbol]; }
+	uint32_t MaxCount() const					{ return max_count; }
+
+	size_t FindRun(uint32_t pos) const;
+	uint32_t Rank(uint8_t symbol, uint32_t pos) const;
+	bool Select(uint8_t symbol, uint32_t i, uint32_t &pos) const;
+};
+
+// *******************************************************************************************
 class CPBWT
 {
 	size_t no_items;
@@ -22,7 +57,22 @@ class CPBWT
 	vector<int> v_perm_prev;
 	vector<uint8_t> v_tmp;
 
+	// Ranks of items in v_perm_prev (rebuilt lazily, used only for sparse rows)
+	vector<uint32_t> v_rank;
+	bool rank_valid;
+
+	// Items set to non-zero values by the last sparse decoding (the remaining items of the output are zeros)
+	vector<int> v_output_nonzero;
+	bool output_sparse;
+	const uint8_t *sparse_output_data;		// identity of the output vector of the last sparse decoding
+
+	vector<pair<uint32_t, uint8_t>> v_sparse;
+
+	void encode_sparse(vector<uint8_t> &v_input, const vector<uint32_t> &v_nonzero, vector<pair<uint8_t, uint32_t>> &v_rle);
+	void decode_sparse(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t> &v_output);
+
 	vector<uint32_t> v_hist_complete;
+	vector<uint32_t> v_order_tmp;
 
 public:
 	CPBWT();
@@ -31,15 +81,75 @@ public:
 	bool StartForward(const size_t _no_items, const size_t _neglect_limit);
 	bool StartReverse(const size_t _no_items, const size_t _neglect_limit);
 
+	bool GetPermutation(vector<int> &v_perm);
+	bool SetPermutation(const vector<int> &v_perm);
+
 	bool Encode(vector<uint8_t> &v_input, vector<pair<uint8_t, uint32_t>> &v_rle);
+	bool Encode(vector<uint8_t> &v_input, const vector<uint32_t> &v_nonzero, vector<pair<uint8_t, uint32_t>> &v_rle);
+	// Sparse rows clear only the items set by the previous call if v_output is the same (unmodified) vector as then;
+	// for any other vector the output is cleared completely
 	bool Decode(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint8_t> &v_output);
 
-	bool TrackItem(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t &value, uint32_t &item_new_pos);
-	bool TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, array<uint32_t, 2> item_prev_pos, array<uint8_t, 2> &value, array<uint32_t, 2> &item_new_pos);
+	bool TrackItems(const vector<pair<uint8_t, uint32_t>> &v_rle, vector<uint32_t> &v_item_pos, vector<uint32_t> &v_order, vector<uint8_t> &v_value);
+
+	bool EstimateValue(const CRLERow &row, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos);
+};
+
+// *******************************************************************************************
+// Divergence array of the PBWT order of items stored as starts of matches: the item at position i has the same values
+// as the item at position i - 1 in all rows since Start(i). Maxima of blocks of positions make range queries fast.
+class CDivergenceArray
+{
+	friend class CPBWTDivergence;
+
+	static const uint32_t block_size = 64;
+	static const uint32_t super_block_size = 64 * block_size;
+
+	vector<uint32_t> v_start;
+	vector<uint32_t> v_block_max;
+	vector<uint32_t> v_super_block_max;
+
+	void set_start(uint32_t pos, uint32_t start);
+	void clear_maxima();
 
-	bool RevertDecode(uint32_t &pos_sample_to_trace, const vector<pair<uint8_t, uint32_t>> &hist_rle_genotypes, const uint8_t reference_value);
+public:
+	CDivergenceArray(size_t no_items);
+
+	// Max. start of matches at positions [from, to), i.e., start of the common match of items at positions from - 1, ..., to - 1
+	uint32_t MaxStart(uint32_t from, uint32_t to) const;
+};
+
+// *******************************************************************************************
+// Divergence array maintained alongside the PBWT of consecutive rows (the same as in the reverse PBWT of the database).
+// Arrays before rows permuting the items are not modified later, so they can be shared by trackers of many samples.
+class CPBWTDivergence
+{
+	size_t no_items;
+	size_t neglect_limit;
+	uint32_t no_rows;
+
+	// Arrays released by all their users are recycled; the list is shared with deleters of the arrays, as they can outlive this object
+	struct free_arrays_t {
+		mutex mtx;
+		vector<CDivergenceArray*> v_arrays;
+
+		~free_arrays_t()
+		{
+			for (auto p : v_arrays)
+				delete p;
+		}
+	};
+
+	shared_ptr<free_arrays_t> free_arrays;
+	shared_ptr<CDivergenceArray> cur;
+
+	shared_ptr<CDivergenceArray> get_array();
+
+public:
+	CPBWTDivergence(const size_t _no_items, const size_t _neglect_limit);
 
-	bool EstimateValue(const vector<pair<uint8_t, uint32_t>> &v_rle, uint32_t item_prev_pos, uint8_t value, array<pair<uint8_t, uint32_t>, 2> &runs, uint32_t &item_new_pos);
+	// Move to the next row; for rows permuting the items the array before the row is returned (nullptr otherwise)
+	shared_ptr<const CDivergenceArray> Add(const CRLERow &row);
 };
 
 // EOF
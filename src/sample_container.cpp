@@ -0,0 +1,285 @@
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include "sample_container.h"
+
+#include <iostream>
+
+const uint8_t CSampleContainer::FLAG_EXTRA_VARIANTS;
+
+// ************************************************************************************
+CSampleContainer::CSampleContainer()
+{
+	mode = mode_t::none;
+	f = nullptr;
+	dir_offset = 0;
+	end_offset = 0;
+	appended = false;
+	success = true;
+}
+
+// ************************************************************************************
+CSampleContainer::~CSampleContainer()
+{
+	Close();
+}
+
+// ************************************************************************************
+bool CSampleContainer::read_directory(CMappedFile &fm)
+{
+	size_t file_size = fm.FileSize();
+	size_t header_size = MAGIC.size() + 8;
+
+	if (file_size < header_size + 4)
+		return false;
+
+	if (memcmp(fm.Data(0), MAGIC.data(), MAGIC.size()) != 0)
+		return false;
+
+	// Data after the directory (from an interrupted appending) is ignored
+	fm.Seek(MAGIC.size());
+	dir_offset = fm.ReadUInt(8);
+
+	if (dir_offset < header_size || dir_offset + 4 > file_size)
+		return false;
+
+	fm.Seek(dir_offset);
+	uint32_t no_members = (uint32_t) fm.ReadUInt(4);
+
+	v_members.clear();
+	m_members.clear();
+
+	for (uint32_t i = 0; i < no_members; ++i)
+	{
+		member_t member;
+
+		if (fm.GetPos() + 2 > file_size)
+			return false;
+		uint32_t name_size = (uint32_t) fm.ReadUInt(2);
+
+		if (fm.GetPos() + name_size + 17 > file_size)
+			return false;
+		member.name.assign((const char *) fm.Data(fm.GetPos()), name_size);
+		fm.Seek(fm.GetPos() + name_size);
+
+		member.offset = fm.ReadUInt(8);
+		member.size = fm.ReadUInt(8);
+		member.flags = fm.GetByte();
+
+		if (member.offset < header_size || member.offset + member.size > dir_offset)
+			return false;
+
+		m_members[member.name] = v_members.size();
+		v_members.push_back(member);
+	}
+
+	return true;
+}
+
+// ************************************************************************************
+// New directory is written after the members and flushed before its offset replaces the old one in the header
+bool CSampleContainer::write_directory()
+{
+	vector<uint8_t> v_dir;
+	CVectorIOStream vos_dir(v_dir);
+
+	vos_dir.WriteUInt(v_members.size(), 4);
+
+	for (auto &member : v_members)
+	{
+		vos_dir.WriteUInt(member.name.size(), 2);
+		vos_dir.Write((const uint8_t *) member.name.data(), member.name.size());
+		vos_dir.WriteUInt(member.offset, 8);
+		vos_dir.WriteUInt(member.size, 8);
+		vos_dir.PutByte(member.flags);
+	}
+
+	if (my_fseek(f, end_offset, SEEK_SET) != 0 || fwrite(v_dir.data(), 1, v_dir.size(), f) != v_dir.size() || fflush(f) != 0)
+		return false;
+
+	vector<uint8_t> v_offset;
+	CVectorIOStream vos_offset(v_offset);
+
+	vos_offset.WriteUInt(end_offset, 8);
+
+	if (my_fseek(f, MAGIC.size(), SEEK_SET) != 0 || fwrite(v_offset.data(), 1, v_offset.size(), f) != v_offset.size() || fflush(f) != 0)
+		return false;
+
+	dir_offset = end_offset;
+
+	return true;
+}
+
+// ************************************************************************************
+bool CSampleContainer::OpenForReading(string file_name)
+{
+	if (mode != mode_t::none)
+		return false;
+
+	// Members are read in random order (possibly by many threads)
+	if (!fm_container.Open(file_name, CMappedFile::access_t::random))
+		return false;
+
+	if (!read_directory(fm_container))
+	{
+		cerr << file_name << " is not a correct sample container\n";
+		fm_container.Close();
+		return false;
+	}
+
+	mode = mode_t::read;
+
+	return true;
+}
+
+// ************************************************************************************
+bool CSampleContainer::OpenForAppending(string file_name)
+{
+	if (mode != mode_t::none)
+		return false;
+
+	v_members.clear();
+	m_members.clear();
+
+	FILE *f_test = fopen(file_name.c_str(), "rb");
+	bool exists = f_test != nullptr;
+	bool empty = true;
+
+	if (f_test)
+	{
+		empty = fgetc(f_test) == EOF;
+		fclose(f_test);
+	}
+
+	if (exists && !empty)
+	{
+		CMappedFile fm;
+
+		if (!fm.Open(file_name))
+			return false;
+
+		if (!read_directory(fm))
+		{
+			cerr << file_name << " is not a correct sample container\n";
+			return false;
+		}
+		fm.Close();
+
+		f = fopen(file_name.c_str(), "r+b");
+		if (!f)
+			return false;
+	}
+	else
+	{
+		f = fopen(file_name.c_str(), "w+b");
+		if (!f)
+			return false;
+
+		// Empty container: the directory (with no members) follows the header
+		dir_offset = MAGIC.size() + 8;
+		end_offset = dir_offset;
+		if (fwrite(MAGIC.data(), 1, MAGIC.size(), f) != MAGIC.size() || !write_directory())
+		{
+			fclose(f);
+			f = nullptr;
+			return false;
+		}
+	}
+
+	// New members are placed after the end of the file, so the current directory stays valid until the new one is written
+	if (my_fseek(f, 0, SEEK_END) != 0)
+	{
+		fclose(f);
+		f = nullptr;
+		return false;
+	}
+	end_offset = my_ftell(f);
+
+	mode = mode_t::append;
+	appended = false;
+	success = true;
+
+	return true;
+}
+
+// ************************************************************************************
+bool CSampleContainer::Close()
+{
+	bool r = true;
+
+	if (mode == mode_t::read)
+		fm_container.Close();
+	else if (mode == mode_t::append)
+	{
+		// After a failed write the previous directory is kept
+		r = success && (!appended || write_directory());
+		r &= fclose(f) == 0;
+		f = nullptr;
+	}
+
+	mode = mode_t::none;
+
+	return r;
+}
+
+// ************************************************************************************
+size_t CSampleContainer::NoMembers() const
+{
+	return v_members.size();
+}
+
+// ************************************************************************************
+const CSampleContainer::member_t& CSampleContainer::Member(size_t id) const
+{
+	return v_members[id];
+}
+
+// ************************************************************************************
+bool CSampleContainer::FindMember(const string &name, size_t &id) const
+{
+	auto p = m_members.find(name);
+
+	if (p == m_members.end())
+		return false;
+
+	id = p->second;
+
+	return true;
+}
+
+// ************************************************************************************
+const uint8_t *CSampleContainer::MemberData(size_t id)
+{
+	if (mode != mode_t::read)
+		return nullptr;
+
+	return fm_container.Data(v_members[id].offset);
+}
+
+// ************************************************************************************
+bool CSampleContainer::AppendMember(const string &name, const vector<uint8_t> &v_data, uint8_t flags)
+{
+	if (mode != mode_t::append || name.size() > 0xffff || m_members.count(name))
+		return false;
+
+	if (fwrite(v_data.data(), 1, v_data.size(), f) != v_data.size())
+	{
+		success = false;
+		return false;
+	}
+
+	m_members[name] = v_members.size();
+	v_members.push_back(member_t{name, end_offset, v_data.size(), flags});
+	end_offset += v_data.size();
+	appended = true;
+
+	return true;
+}
+
+// EOF
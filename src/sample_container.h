@@ -0,0 +1,75 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+
+#include "io.h"
+
+using namespace std;
+
+// *******************************************************************************************
+// Many compressed samples in a single file.
+// Layout: magic, directory offset (8B), members (each is the contents of a separate sample file), directory.
+// New members and then a new directory are appended after the end of the file; the directory offset is updated last,
+// so the container stays valid (with its previous contents) if appending is interrupted.
+class CSampleContainer
+{
+public:
+	typedef struct {
+		string name;
+		uint64_t offset;
+		uint64_t size;
+		uint8_t flags;
+	} member_t;
+
+	static const uint8_t FLAG_EXTRA_VARIANTS = 1;
+
+private:
+	const string MAGIC = "GTSC";
+
+	enum class mode_t {none, read, append} mode;
+
+	CMappedFile fm_container;
+	FILE *f;
+	uint64_t dir_offset;
+	uint64_t end_offset;			// appending: position of the next member
+	bool appended;
+	bool success;
+
+	vector<member_t> v_members;
+	unordered_map<string, size_t> m_members;
+
+	bool read_directory(CMappedFile &fm);
+	bool write_directory();
+
+public:
+	CSampleContainer();
+	~CSampleContainer();
+
+	bool OpenForReading(string file_name);
+	// Container is created if it does not exist
+	bool OpenForAppending(string file_name);
+	bool Close();
+
+	size_t NoMembers() const;
+	const member_t& Member(size_t id) const;
+	bool FindMember(const string &name, size_t &id) const;
+
+	// Contents of the member (valid until Close; in read mode only)
+	const uint8_t *MemberData(size_t id);
+
+	// Name of the member must be unique
+	bool AppendMember(const string &name, const vector<uint8_t> &v_data, uint8_t flags);
+};
+
+// EOF
@@ -0,0 +1,156 @@
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include "sample_tracker.h"
+
+#include <algorithm>
+
+// ************************************************************************************
+CRowStore::CRowStore()
+{
+	first_id = 0;
+}
+
+// ************************************************************************************
+CRowStore::~CRowStore()
+{
+	for (auto p : q_rows)
+		delete p;
+	for (auto p : v_free)
+		delete p;
+}
+
+// ************************************************************************************
+CRLERow* CRowStore::Add()
+{
+	CRLERow *p;
+
+	if (v_free.empty())
+		p = new CRLERow;
+	else
+	{
+		p = v_free.back();
+		v_free.pop_back();
+	}
+
+	q_rows.push_back(p);
+
+	return p;
+}
+
+// ************************************************************************************
+uint64_t CRowStore::NextId() const
+{
+	return first_id + q_rows.size();
+}
+
+// ************************************************************************************
+void CRowStore::Release(uint64_t id)
+{
+	for (; first_id < id && !q_rows.empty(); ++first_id)
+	{
+		v_free.push_back(q_rows.front());
+		q_rows.pop_front();
+	}
+}
+
+// ************************************************************************************
+CSampleTracker::CSampleTracker(CCompressedFile *_cfile, uint32_t _max_match_len)
+{
+	cfile = _cfile;
+	ploidy = cfile->GetPloidy();
+	max_match_len = _max_match_len;
+
+	// New sample is placed after all haplotypes of the database
+	sample_pos_perm.fill(ploidy * (uint32_t) cfile->GetNoSamples());
+	pred_match_start.fill(0);
+	succ_match_start.fill(0);
+	no_rows.fill(0);
+}
+
+// ************************************************************************************
+uint32_t CSampleTracker::GetPloidy() const
+{
+	return ploidy;
+}
+
+// ************************************************************************************
+uint32_t CSampleTracker::NoPredSame(uint32_t j) const
+{
+	return min(no_rows[j] - pred_match_start[j], max_match_len);
+}
+
+// ************************************************************************************
+uint32_t CSampleTracker::NoSuccSame(uint32_t j) const
+{
+	return min(no_rows[j] - succ_match_start[j], max_match_len);
+}
+
+// ************************************************************************************
+// Last position before max_pos containing value
+bool CSampleTracker::find_prev_value(const CRLERow &row, const uint32_t max_pos, const uint8_t value, uint32_t &found_pos)
+{
+	uint32_t r = row.Rank(value, max_pos);
+	if (r == 0)
+		return false;
+
+	return row.Select(value, r - 1, found_pos);
+}
+
+// ************************************************************************************
+// First position not before min_pos containing value
+bool CSampleTracker::find_next_value(const CRLERow &row, const uint32_t min_pos, const uint8_t value, uint32_t &found_pos)
+{
+	uint32_t r = row.Rank(value, min_pos);
+	if (r == row.Rank(value, row.Size()))
+		return false;
+
+	return row.Select(value, r, found_pos);
+}
+
+// ************************************************************************************
+void CSampleTracker::GetRuns(const CRLERow &row, uint32_t j, run_t &runs)
+{
+	uint32_t tmp;
+
+	cfile->EstimateValue(row, sample_pos_perm[j], 0, runs, tmp);
+}
+
+// ************************************************************************************
+// The haplotype is placed between items at positions pos - 1 and pos. If a neighbour has a different value,
+// the new one is the closest item of the same value (if the row permutes items) and the matches of all items between them
+// bound the new match (as in Durbin's update of divergence arrays); otherwise the match ends.
+void CSampleTracker::Update(const CRLERow &row, const CDivergenceArray *div, uint64_t row_id, uint32_t j, uint8_t value, run_t &runs)
+{
+	uint32_t pos = sample_pos_perm[j];
+	uint32_t new_start = (uint32_t) row_id + 1;
+	uint32_t found_pos;
+
+	cfile->EstimateValue(row, pos, value, runs, sample_pos_perm[j]);
+
+	if (!runs[0].second || runs[0].first != value)
+	{
+		if (div && find_prev_value(row, pos, value, found_pos))
+			pred_match_start[j] = max(pred_match_start[j], div->MaxStart(found_pos + 1, pos));
+		else
+			pred_match_start[j] = new_start;
+	}
+
+	if (!runs[1].second || runs[1].first != value)
+	{
+		if (div && find_next_value(row, pos, value, found_pos))
+			succ_match_start[j] = max(succ_match_start[j], div->MaxStart(pos + 1, found_pos + 1));
+		else
+			succ_match_start[j] = new_start;
+	}
+
+	no_rows[j] = new_start;
+}
+
+// EOF
@@ -0,0 +1,75 @@
+#pragma once
+// *******************************************************************************************
+// This file is a part of GTShark software distributed under GNU GPL 3 licence.
+// The homepage of the GTShark project is https://github.com/refresh-bio/GTShark
+//
+// Author : Sebastian Deorowicz and Agnieszka Danek
+// Version: 1.1
+// Date   : 2019-05-09
+// *******************************************************************************************
+
+#include <vector>
+#include <deque>
+#include <array>
+
+#include "defs.h"
+#include "pbwt.h"
+#include "cfile.h"
+#include "utils.h"
+
+using namespace std;
+
+// *******************************************************************************************
+// Decoded rows of the database shared by many trackers.
+// Rows get consecutive ids; storage of rows no longer in use is reused.
+class CRowStore
+{
+	deque<CRLERow*> q_rows;			// rows of ids first_id, first_id + 1, ...
+	vector<CRLERow*> v_free;
+	uint64_t first_id;
+
+public:
+	CRowStore();
+	~CRowStore();
+
+	// Storage for the row of id NextId()
+	CRLERow* Add();
+	uint64_t NextId() const;
+
+	// Rows of ids below id can be reused
+	void Release(uint64_t id);
+};
+
+// *******************************************************************************************
+// Position of haplotypes of a new sample in the PBWT of the database and the lengths of their matches
+// with the predecessors and successors in the PBWT order (contexts for the sample file)
+class CSampleTracker
+{
+	CCompressedFile *cfile;
+	uint32_t ploidy;
+	uint32_t max_match_len;
+
+	array<uint32_t, 2> sample_pos_perm;
+	array<uint32_t, 2> pred_match_start;		// first rows of matches with the neighbours (as in the divergence array)
+	array<uint32_t, 2> succ_match_start;
+	array<uint32_t, 2> no_rows;					// no. of rows (including skipped ones) when haplotypes were updated
+
+	bool find_prev_value(const CRLERow &row, const uint32_t max_pos, const uint8_t value, uint32_t &found_pos);
+	bool find_next_value(const CRLERow &row, const uint32_t min_pos, const uint8_t value, uint32_t &found_pos);
+
+public:
+	CSampleTracker(CCompressedFile *_cfile, uint32_t _max_match_len);
+
+	uint32_t GetPloidy() const;
+	uint32_t NoPredSame(uint32_t j) const;
+	uint32_t NoSuccSame(uint32_t j) const;
+
+	// Runs around j-th haplotype of the sample before it is moved by the row
+	void GetRuns(const CRLERow &row, uint32_t j, run_t &runs);
+
+	// Move j-th haplotype of the sample having the value in the row; runs around its previous position are returned.
+	// div is the divergence array of the database before the row if the row permutes haplotypes (nullptr otherwise).
+	void Update(const CRLERow &row, const CDivergenceArray *div, uint64_t row_id, uint32_t j, uint8_t value, run_t &runs);
+};
+
+// EOF
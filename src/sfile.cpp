@@ -12,6 +12,8 @@
 #include "utils.h"
 #include "lzma_wrapper.h"
 
+#include <cstring>
+
 // ************************************************************************************
 CSampleFile::CSampleFile()
 {
@@ -20,8 +22,10 @@ CSampleFile::CSampleFile()
 	rcd = nullptr;
 
 	vios = new CVectorIOStream(v_uint8);
+	vos_file = new CVectorIOStream(v_file);
 
 	mode = mode_t::none;
+	no_threads = 1;
 }
 
 // ************************************************************************************
@@ -33,35 +37,56 @@ CSampleFile::~CSampleFile()
 		delete rc;
 
 	delete vios;
+	delete vos_file;
 }
 
 // ************************************************************************************
 bool CSampleFile::OpenForReading(string file_name, bool& _extra_variants)
 {
-	if (!fi_sample.Open(file_name))
+	if (!fm_sample.Open(file_name, CMappedFile::access_t::sequential))
 	{
 		cerr << "Cannot open " << file_name << " file\n";
 		exit(1);
 	}
 
+	bool r = OpenForReading(fm_sample.Data(0), fm_sample.FileSize(), _extra_variants);
+	fm_sample.Close();				// all data are in memory, so many files can be read at once
+
+	return r;
+}
+
+// ************************************************************************************
+bool CSampleFile::OpenForReading(const uint8_t *data, size_t size, bool& _extra_variants)
+{
+	if (size < 4)
+	{
+		cerr << "Corrupted sample data\n";
+		return false;
+	}
+
+	mis_sample.Attach(data, size);
+
+	uint8_t version = mis_sample.GetByte();
+	if (version != format_version)
+	{
+		cerr << "Unsupported version " << (int) version << " of sample data (expected " << (int) format_version << ")\n";
+		mis_sample.Attach(nullptr, 0);
+		return false;
+	}
+
 	rc = new CRangeDecoder<CVectorIOStream>(*vios);
 	rcd = (CRangeDecoder<CVectorIOStream>*) rc;
 
-	size_t file_size = fi_sample.FileSize();
-	_extra_variants = (bool) fi_sample.GetByte();
+	_extra_variants = (bool) mis_sample.GetByte();
 	extra_variants = _extra_variants;
 
-	file_size -= read_header_data();
-	file_size--;						// extra variants info
+	read_header_data();
 
 	if (extra_variants)
-		file_size -= read_extra_variants();
-
-	v_uint8.clear();
-	v_uint8.reserve(file_size);
+		read_extra_variants();
 
-	while (!fi_sample.Eof())
-		v_uint8.push_back(fi_sample.GetByte());
+	v_uint8.assign(data + mis_sample.GetPos(), data + size);
+	mis_sample.Attach(nullptr, 0);
 
 	rcd->Start();
 
@@ -74,17 +99,21 @@ bool CSampleFile::OpenForReading(string file_name, bool& _extra_variants)
 // ************************************************************************************
 bool CSampleFile::OpenForWriting(string file_name, bool _extra_variants)
 {
-	if (!fo_sample.Open(file_name))
+	// The file is written at Close
+	if (!file_name.empty() && !fo_sample.Open(file_name, 1 << 16))
 	{
 		cerr << "Cannot open " << file_name << " file\n";
 		exit(1);
 	}
 
+	output_file_name = file_name;
 	mode = mode_t::compress;
 	extra_variants = _extra_variants;
 	ctx_flag = 0;
 
-	fo_sample.PutByte((uint8_t)extra_variants);
+	v_file.clear();
+	vos_file->PutByte(format_version);
+	vos_file->PutByte((uint8_t)extra_variants);
 
 	rc = new CRangeEncoder<CVectorIOStream>(*vios);
 	rce = (CRangeEncoder<CVectorIOStream>*) rc;
@@ -97,19 +126,41 @@ bool CSampleFile::OpenForWriting(string file_name, bool _extra_variants)
 // ************************************************************************************
 bool CSampleFile::Close()
 {
+	bool r = true;
+
 	if (mode == mode_t::compress)
 	{
 		rce->End();
-		fo_sample.Write(vios->Data(), vios->Size());
-		fo_sample.Close();
+		vos_file->Write(vios->Data(), vios->Size());
+
+		v_uint8.clear();
+		v_uint8.shrink_to_fit();
+
+		if (!output_file_name.empty())
+		{
+			fo_sample.Write(v_file.data(), v_file.size());
+			r = fo_sample.Close();
+		}
 	}
 	else if (mode == mode_t::decompress)
-	{
 		rcd->End();
-		fi_sample.Close();
-	}
 
-	return true;
+	mode = mode_t::none;
+
+	return r;
+}
+
+// ************************************************************************************
+void CSampleFile::GetData(vector<uint8_t> &v_data)
+{
+	v_data = move(v_file);
+	v_file.clear();
+}
+
+// ************************************************************************************
+void CSampleFile::SetNoThreads(uint32_t _no_threads)
+{
+	no_threads = _no_threads;
 }
 
 // ************************************************************************************
@@ -117,27 +168,27 @@ uint32_t CSampleFile::read_header_data()
 {
 	uint32_t readed_bytes = 0;
 
-	uint8_t header_present = fi_sample.GetByte();
+	uint8_t header_present = mis_sample.GetByte();
 	++readed_bytes;
 
 	if (header_present)
 	{
-		uint32_t header_compressed_size = fi_sample.ReadUInt(4);
+		uint32_t header_compressed_size = mis_sample.ReadUInt(4);
 		readed_bytes += 4;
 
 		input_vec_rel_header.resize(header_compressed_size);
 		
-		fi_sample.Read(input_vec_rel_header.data(), header_compressed_size);
+		mis_sample.Read(input_vec_rel_header.data(), header_compressed_size);
 		readed_bytes += header_compressed_size;
 	}
 
-	uint32_t sample_name_size = fi_sample.ReadUInt(2);
+	uint32_t sample_name_size = mis_sample.ReadUInt(2);
 	readed_bytes += 2;
 	
 	input_sample_name.reserve(sample_name_size + 1);
 	
 	for(uint32_t i = 0; i < sample_name_size; ++i)
-		input_sample_name.push_back(fi_sample.Get());
+		input_sample_name.push_back((char) mis_sample.GetByte());
 
 	readed_bytes += sample_name_size;
 
@@ -147,7 +198,7 @@ uint32_t CSampleFile::read_header_data()
 // ************************************************************************************
 uint32_t CSampleFile::read_extra_variants()
 {
-	uint32_t ev_present = fi_sample.GetByte();
+	uint32_t ev_present = mis_sample.GetByte();
 	uint32_t no_bytes = 0;
 
 	if (!ev_present)
@@ -163,28 +214,32 @@ uint32_t CSampleFile::read_extra_variants()
 	vector<uint8_t> vr_info, vc_info;
 	vector<uint8_t> vr_gt, vc_gt;
 
-	for (auto d : {
-		make_tuple(ref(vr_chrom), ref(vc_chrom), 9, "chrom"),
-		make_tuple(ref(vr_pos), ref(vc_pos), 9, "pos"),
-		make_tuple(ref(vr_id), ref(vc_id), 9, "id"),
-		make_tuple(ref(vr_ref), ref(vc_ref), 9, "ref"),
-		make_tuple(ref(vr_alt), ref(vc_alt), 9, "alt"),
-		make_tuple(ref(vr_qual), ref(vc_qual), 9, "qual"),
-		make_tuple(ref(vr_filter), ref(vc_filter), 9, "filter"),
-		make_tuple(ref(vr_info), ref(vc_info), 9, "info"),
-		make_tuple(ref(vr_gt), ref(vc_gt), 9, "gt")
-		})
+	vector<tuple<vector<uint8_t>*, vector<uint8_t>*, int, string>> v_columns = {
+		make_tuple(&vr_chrom, &vc_chrom, 9, "chrom"),
+		make_tuple(&vr_pos, &vc_pos, 9, "pos"),
+		make_tuple(&vr_id, &vc_id, 9, "id"),
+		make_tuple(&vr_ref, &vc_ref, 9, "ref"),
+		make_tuple(&vr_alt, &vc_alt, 9, "alt"),
+		make_tuple(&vr_qual, &vc_qual, 9, "qual"),
+		make_tuple(&vr_filter, &vc_filter, 9, "filter"),
+		make_tuple(&vr_info, &vc_info, 9, "info"),
+		make_tuple(&vr_gt, &vc_gt, 9, "gt")
+	};
+
+	for (auto &d : v_columns)
 	{
-		uint32_t comp_size = fi_sample.ReadUInt(4);
-		get<1>(d).resize(comp_size);
-		fi_sample.Read(get<1>(d).data(), get<1>(d).size());
+		uint32_t comp_size = mis_sample.ReadUInt(4);
+		get<1>(d)->resize(comp_size);
+		mis_sample.Read(get<1>(d)->data(), get<1>(d)->size());
 
 		no_bytes += 4 + comp_size;
-
-		CLZMAWrapper::Decompress(get<1>(d), get<0>(d));
-//		cout << get<3>(d) << " size: " << get<1>(d).size() << endl;
 	}
 
+	// Columns are decompressed in parallel
+	parallel_for(v_columns.size(), no_threads, [&](size_t i) {
+		CLZMAWrapper::Decompress(*get<1>(v_columns[i]), *get<0>(v_columns[i]));
+	});
+
 	auto p_chrom = vr_chrom.begin();
 	auto p_id = vr_id.begin();
 	auto p_ref = vr_ref.begin();
@@ -198,15 +253,15 @@ uint32_t CSampleFile::read_extra_variants()
 	int prev_pos = 0;
 	while(true)
 	{
-		loc_v_desc.push_back(make_pair(variant_desc_t(), vector<uint8_t>()));
-
-		loc_v_desc.back().first.chrom = get_string_from_vector(p_chrom);
-		loc_v_desc.back().first.id = get_string_from_vector(p_id);
-		loc_v_desc.back().first.ref = get_string_from_vector(p_ref);
-		loc_v_desc.back().first.alt = get_string_from_vector(p_alt);
-		loc_v_desc.back().first.qual = get_string_from_vector(p_qual);
-		loc_v_desc.back().first.filter = get_string_from_vector(p_filter);
-		loc_v_desc.back().first.info = get_string_from_vector(p_info);
+		loc_v_desc.emplace_back();
+
+		get_string_from_vector(p_chrom, loc_v_desc.back().first.chrom);
+		get_string_from_vector(p_id, loc_v_desc.back().first.id);
+		get_string_from_vector(p_ref, loc_v_desc.back().first.ref);
+		get_string_from_vector(p_alt, loc_v_desc.back().first.alt);
+		get_string_from_vector(p_qual, loc_v_desc.back().first.qual);
+		get_string_from_vector(p_filter, loc_v_desc.back().first.filter);
+		get_string_from_vector(p_info, loc_v_desc.back().first.info);
 		
 		uint32_t dif_pos = 0;
 		for (int i = 0; i < 4; ++i)
@@ -226,16 +281,13 @@ uint32_t CSampleFile::read_extra_variants()
 }
 
 // ************************************************************************************
-string CSampleFile::get_string_from_vector(vector<uint8_t>::iterator& p)
+// Zero-terminated string is copied at once (the storage of x is reused)
+void CSampleFile::get_string_from_vector(vector<uint8_t>::iterator& p, string &x)
 {
-	string r;
-
-	for (; *p; ++p)
-		r.push_back((char)* p);
+	size_t len = strlen((const char *) &*p);
 
-	++p;			// skip terminator
-
-	return r;
+	x.assign((const char *) &*p, len);
+	p += len + 1;			// skip terminator
 }
 
 // ************************************************************************************
@@ -249,7 +301,7 @@ uint32_t CSampleFile::WriteExtraVariants(const vector<pair<variant_desc_t, vecto
 {
 	if (v_desc.empty())
 	{
-		fo_sample.PutByte(0);			// no extra data
+		vos_file->PutByte(0);			// no extra data
 		return 1;
 	}
 
@@ -289,27 +341,33 @@ uint32_t CSampleFile::WriteExtraVariants(const vector<pair<variant_desc_t, vecto
 	// Save variant descriptions
 	uint32_t no_bytes = 0;
 	
-	fo_sample.PutByte(1);
+	vos_file->PutByte(1);
 	++no_bytes;
 
-	for (auto d : {
-		make_tuple(ref(vr_chrom), ref(vc_chrom), 9, "chrom"),
-		make_tuple(ref(vr_pos), ref(vc_pos), 9, "pos"),
-		make_tuple(ref(vr_id), ref(vc_id), 9, "id"),
-		make_tuple(ref(vr_ref), ref(vc_ref), 9, "ref"),
-		make_tuple(ref(vr_alt), ref(vc_alt), 9, "alt"),
-		make_tuple(ref(vr_qual), ref(vc_qual), 9, "qual"),
-		make_tuple(ref(vr_filter), ref(vc_filter), 9, "filter"),
-		make_tuple(ref(vr_info), ref(vc_info), 9, "info"),
-		make_tuple(ref(vr_gt), ref(vc_gt), 9, "gt")
-		})
+	vector<tuple<vector<uint8_t>*, vector<uint8_t>*, int, string>> v_columns = {
+		make_tuple(&vr_chrom, &vc_chrom, 9, "chrom"),
+		make_tuple(&vr_pos, &vc_pos, 9, "pos"),
+		make_tuple(&vr_id, &vc_id, 9, "id"),
+		make_tuple(&vr_ref, &vc_ref, 9, "ref"),
+		make_tuple(&vr_alt, &vc_alt, 9, "alt"),
+		make_tuple(&vr_qual, &vc_qual, 9, "qual"),
+		make_tuple(&vr_filter, &vc_filter, 9, "filter"),
+		make_tuple(&vr_info, &vc_info, 9, "info"),
+		make_tuple(&vr_gt, &vc_gt, 9, "gt")
+	};
+
+	// Columns are compressed in parallel
+	parallel_for(v_columns.size(), no_threads, [&](size_t i) {
+		CLZMAWrapper::Compress(*get<0>(v_columns[i]), *get<1>(v_columns[i]), get<2>(v_columns[i]));
+	});
+
+	for (auto &d : v_columns)
 	{
-		CLZMAWrapper::Compress(get<0>(d), get<1>(d), get<2>(d));
-//		cout << get<3>(d) << " size: " << get<1>(d).size() << endl;
-		fo_sample.WriteUInt(get<1>(d).size(), 4);
-		fo_sample.Write(get<1>(d).data(), get<1>(d).size());
+//		cout << get<3>(d) << " size: " << get<1>(d)->size() << endl;
+		vos_file->WriteUInt(get<1>(d)->size(), 4);
+		vos_file->Write(get<1>(d)->data(), get<1>(d)->size());
 
-		no_bytes += 4 + get<1>(d).size();
+		no_bytes += 4 + get<1>(d)->size();
 	}
 
 	return no_bytes;
@@ -319,22 +377,22 @@ uint32_t CSampleFile::WriteExtraVariants(const vector<pair<variant_desc_t, vecto
 bool CSampleFile::WriteHeaderAndSample(const string &db_header, const string &v_header, const string &sample_name)
 {
 	if (input_vec_rel_header.empty())
-		fo_sample.PutByte(0);		// header absent
+		vos_file->PutByte(0);		// header absent
 	else
 	{
-		fo_sample.PutByte(1);		// header present
+		vos_file->PutByte(1);		// header present
 
 		vector<uint8_t> vec_header(db_header.begin(), db_header.end());
 		vector<uint8_t> vec_v_header(v_header.begin(), v_header.end());
 		vector<uint8_t> vec_rel_header;
 
 		CLZMAWrapper::CompressWithHistory(vec_header, vec_v_header, vec_rel_header, 9);
-		fo_sample.WriteUInt(vec_rel_header.size(), 4);
-		fo_sample.Write(vec_rel_header.data(), vec_rel_header.size());
+		vos_file->WriteUInt(vec_rel_header.size(), 4);
+		vos_file->Write(vec_rel_header.data(), vec_rel_header.size());
 	}
 
-	fo_sample.WriteUInt(sample_name.size(), 2);
-	fo_sample.Write((uint8_t *) sample_name.data(), sample_name.size());
+	vos_file->WriteUInt(sample_name.size(), 2);
+	vos_file->Write((uint8_t *) sample_name.data(), sample_name.size());
 
 	return true;
 }
@@ -17,16 +17,28 @@
 #include "sub_rc.h"
 #include "context_hm.h"
 
+// *******************************************************************************************
+// Compressed sample; it is built in memory, so it can be stored as a separate file or as a member of a container
 class CSampleFile
 {
-	CInFile fi_sample;
+	CMappedFile fm_sample;
+	CMemoryInStream mis_sample;
 	COutFile fo_sample;
+	string output_file_name;
+
+	vector<uint8_t> v_file;				// contents of the file except range coder data
+	CVectorIOStream *vos_file;
 
 	string input_sample_name;
 	vector<uint8_t> input_vec_rel_header;
 	bool extra_variants;
 
+	// Version of the format of sample data (the first byte of data of earlier versions is the extra variants flag: 0 or 1)
+	// 2 - contexts from matches of the divergence array
+	const uint8_t format_version = 2;
+
 	enum class mode_t {none, compress, decompress} mode;
+	uint32_t no_threads;
 
 	CBasicRangeCoder<CVectorIOStream> *rc;
 	CRangeEncoder<CVectorIOStream> *rce;
@@ -50,15 +62,21 @@ class CSampleFile
 	uint32_t read_extra_variants();
 
 	vector<pair<variant_desc_t, vector<uint8_t>>> loc_v_desc;
-	string get_string_from_vector(vector<uint8_t>::iterator& p);
+	void get_string_from_vector(vector<uint8_t>::iterator& p, string &x);
 
 public:
 	CSampleFile();
 	~CSampleFile();
 
 	bool OpenForReading(string file_name, bool &_extra_variants);
+	// Data are copied, so they need to be valid only during the call
+	bool OpenForReading(const uint8_t *data, size_t size, bool &_extra_variants);
+	// For empty file name the sample is only kept in memory
 	bool OpenForWriting(string file_name, bool _extra_variants);
 	bool Close();
+	// Contents of the file (available after Close in compress mode)
+	void GetData(vector<uint8_t> &v_data);
+	void SetNoThreads(uint32_t _no_threads);
 
 	bool ReadHeaderAndSample(const string &db_header, string &v_header, string &sample_name);
 	bool WriteHeaderAndSample(const string &db_header, const string &v_header, const string &sample_name);
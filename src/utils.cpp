@@ -12,6 +12,8 @@
 #include <memory>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 #ifdef OUR_STRTOL
 // *****************************************************************************************
@@ -124,4 +126,108 @@ uint64_t popcnt(uint64_t x)
 	return 0;
 }
 
+// *****************************************************************************************
+CThreadPool& CThreadPool::Instance()
+{
+	// Never destroyed, so workers can be still busy when the program exits
+	static CThreadPool *pool = new CThreadPool();
+
+	return *pool;
+}
+
+// *****************************************************************************************
+void CThreadPool::Reserve(uint32_t no_threads)
+{
+	lock_guard<mutex> lck(m_mutex);
+
+	while (m_workers.size() < no_threads)
+	{
+		m_workers.push_back(thread([this] { worker(); }));
+		m_workers.back().detach();
+	}
+}
+
+// *****************************************************************************************
+void CThreadPool::Submit(const function<void()> &task)
+{
+	lock_guard<mutex> lck(m_mutex);
+
+	m_tasks.push_back(task);
+	m_cond.notify_one();
+}
+
+// *****************************************************************************************
+void CThreadPool::worker()
+{
+	while (true)
+	{
+		function<void()> task;
+		{
+			unique_lock<mutex> lck(m_mutex);
+			m_cond.wait(lck, [this] {return !m_tasks.empty(); });
+			task = move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
+
+// *****************************************************************************************
+// Call f(i) for all i in [0, n) using up to no_threads threads.
+// The calling thread takes part in the work and does not wait for helpers which have not started yet, so the pool
+// may be busy (or the calls may be nested) without a risk of a deadlock.
+void parallel_for(size_t n, uint32_t no_threads, const function<void(size_t)> &f)
+{
+	if (no_threads > n)
+		no_threads = (uint32_t) n;
+
+	if (no_threads <= 1)
+	{
+		for (size_t i = 0; i < n; ++i)
+			f(i);
+		return;
+	}
+
+	typedef struct {
+		atomic<size_t> next;
+		mutex mtx;
+		condition_variable cv;
+		uint32_t no_active;
+		bool closed;
+	} state_t;
+
+	shared_ptr<state_t> state(new state_t);
+	state->next = 0;
+	state->no_active = 0;
+	state->closed = false;
+
+	auto &pool = CThreadPool::Instance();
+	pool.Reserve(no_threads - 1);
+
+	for (uint32_t i = 0; i + 1 < no_threads; ++i)
+		pool.Submit([state, n, &f] {
+			{
+				lock_guard<mutex> lck(state->mtx);
+				if (state->closed)
+					return;
+				++state->no_active;
+			}
+
+			for (size_t j = state->next++; j < n; j = state->next++)
+				f(j);
+
+			lock_guard<mutex> lck(state->mtx);
+			if (--state->no_active == 0)
+				state->cv.notify_all();
+		});
+
+	for (size_t j = state->next++; j < n; j = state->next++)
+		f(j);
+
+	unique_lock<mutex> lck(state->mtx);
+	state->closed = true;
+	state->cv.wait(lck, [&] {return state->no_active == 0; });
+}
+
 // EOF
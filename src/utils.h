@@ -15,6 +15,12 @@
 //#include <immintrin.h>
 #include <string>
 #include <vector>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 using namespace std;
 
@@ -33,37 +39,165 @@ void calc_cumulate_histogram(const vector<uint8_t> &data, vector<uint32_t> &v_hi
 void calc_cumulate_histogram(const vector<pair<uint8_t, uint32_t>> &rle_data, vector<uint32_t> &v_hist, uint32_t &max_count);
 
 // *****************************************************************************************
-//
-class CBarrier
+// Pipeline of stages connected by queues of batches. The batches are recycled, so at most depth of them are in progress
+// and the source waits for a free one. Each stage is run by its own thread(s); a stage run by a single thread gets
+// the batches in the order of the source. Processing stops when the source makes no more batches or a stage returns false.
+template<typename T> class CPipeline
 {
 public:
-	CBarrier(const CBarrier&) = delete;
-	CBarrier& operator=(const CBarrier&) = delete;
-	explicit CBarrier(unsigned int count) :
-		m_count(count), m_generation(0),
-		m_count_reset_value(count)
+	CPipeline(const CPipeline&) = delete;
+	CPipeline& operator=(const CPipeline&) = delete;
+	explicit CPipeline(size_t depth) :
+		m_depth(depth)
+	{
+	}
+	// Source fills a batch; it returns false (for unused batch) when there are no more data
+	void SetSource(const std::function<bool(T&)> &source)
+	{
+		m_source = source;
+	}
+	void AddStage(const std::function<bool(T&)> &process, uint32_t no_threads = 1)
 	{
+		m_stages.push_back(stage_t{ process, no_threads, std::map<uint64_t, T*>(), 0 });
 	}
-	void count_down_and_wait()
+	// The source is run in the calling thread
+	void Run()
 	{
-		std::unique_lock< std::mutex > lock(m_mutex);
-		unsigned int gen = m_generation;
-		if (--m_count == 0)
+		std::vector<std::thread> v_threads;
+
+		if (m_batches.size() < m_depth)
+			m_batches.resize(m_depth);
+		m_free.clear();
+		for (auto &b : m_batches)
+		{
+			if (!b)
+				b.reset(new T);
+			m_free.push_back(b.get());
+		}
+		m_no_batches = 0;
+		m_completed = false;
+		m_stopped = false;
+
+		for (size_t i = 0; i < m_stages.size(); ++i)
+		{
+			m_stages[i].m_input.clear();
+			m_stages[i].no_taken = 0;
+			for (uint32_t j = 0; j < m_stages[i].no_threads; ++j)
+				v_threads.push_back(std::thread([this, i] { stage_worker(i); }));
+		}
+
+		while (true)
 		{
-			m_generation++;
-			m_count = m_count_reset_value;
-			m_cond.notify_all();
-			return;
+			T *b;
+			{
+				std::unique_lock< std::mutex > lock(m_mutex);
+				while (m_free.empty())
+					m_cond.wait(lock);
+				b = m_free.back();
+				m_free.pop_back();
+			}
+
+			bool filled = !m_stopped && m_source(*b);
+
+			std::lock_guard< std::mutex > lock(m_mutex);
+			if (!filled)
+			{
+				m_free.push_back(b);
+				m_completed = true;
+				m_cond.notify_all();
+				break;
+			}
+			put(0, b, m_no_batches++);
 		}
-		while (gen == m_generation)
-			m_cond.wait(lock);
+
+		for (auto &t : v_threads)
+			t.join();
 	}
 private:
+	typedef struct {
+		std::function<bool(T&)> process;
+		uint32_t no_threads;
+		std::map<uint64_t, T*> m_input;		// batches waiting for the stage (by id)
+		uint64_t no_taken;
+	} stage_t;
+
+	// Must be called under lock
+	void put(size_t i_stage, T *b, uint64_t id)
+	{
+		if (i_stage < m_stages.size())
+			m_stages[i_stage].m_input[id] = b;
+		else
+			m_free.push_back(b);
+		m_cond.notify_all();
+	}
+	void stage_worker(size_t i_stage)
+	{
+		auto &stage = m_stages[i_stage];
+
+		while (true)
+		{
+			T *b;
+			uint64_t id;
+			{
+				std::unique_lock< std::mutex > lock(m_mutex);
+				while (true)
+				{
+					if (!stage.m_input.empty() && (stage.no_threads > 1 || stage.m_input.begin()->first == stage.no_taken))
+						break;
+					if (m_completed && stage.no_taken == m_no_batches)
+						return;
+					m_cond.wait(lock);
+				}
+				id = stage.m_input.begin()->first;
+				b = stage.m_input.begin()->second;
+				stage.m_input.erase(stage.m_input.begin());
+				++stage.no_taken;
+			}
+
+			// After stop the remaining batches are only passed through
+			if (!m_stopped && !stage.process(*b))
+				m_stopped = true;
+
+			std::lock_guard< std::mutex > lock(m_mutex);
+			put(i_stage + 1, b, id);
+		}
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	size_t m_depth;
+	std::function<bool(T&)> m_source;
+	std::vector<stage_t> m_stages;
+	std::vector<std::unique_ptr<T>> m_batches;
+	std::vector<T*> m_free;
+	uint64_t m_no_batches;
+	bool m_completed;
+	std::atomic<bool> m_stopped;
+};
+
+// *****************************************************************************************
+// Threads shared by all parallel parts of the program (workers are added on demand and live till the end of the program)
+class CThreadPool
+{
+public:
+	CThreadPool(const CThreadPool&) = delete;
+	CThreadPool& operator=(const CThreadPool&) = delete;
+
+	static CThreadPool& Instance();
+
+	// Make sure there are at least no_threads workers
+	void Reserve(uint32_t no_threads);
+	void Submit(const std::function<void()> &task);
+private:
+	CThreadPool()
+	{
+	}
+	void worker();
+
 	std::mutex m_mutex;
 	std::condition_variable m_cond;
-	unsigned int m_count;
-	unsigned int m_generation;
-	unsigned int m_count_reset_value;
+	std::deque<std::function<void()>> m_tasks;
+	std::vector<std::thread> m_workers;
 };
 
 // *****************************************************************************************
@@ -116,6 +250,7 @@ uint64_t no_bytes(T x)
 
 uint64_t popcnt(uint64_t x);
 string trim(string s);
+void parallel_for(size_t n, uint32_t no_threads, const function<void(size_t)> &f);
 
 // *****************************************************************************************
 template <typename T>
@@ -9,6 +9,10 @@
 
 #include "vcf.h"
 #include <iostream>
+#include <htslib/thread_pool.h>
+
+// Thread pool of htslib shared by all files (destroyed by ReleaseThreads after the files are closed)
+static htsThreadPool hts_thread_pool = { nullptr, 0 };
 
 // ************************************************************************************
 CVCF::CVCF()
@@ -20,11 +24,35 @@ CVCF::CVCF()
     tmpia = nullptr;
     ploidy = 0; //default
     first_variant = true;
+    gt_arr = nullptr;
+    n_gt_arr = 0;
+    ks_value = {0, 0, nullptr};
 }
 
 // ************************************************************************************
 CVCF::~CVCF()
 {
+    Close();
+
+    free(gt_arr);
+    free(ks_value.s);
+}
+
+// ************************************************************************************
+void CVCF::SetNoThreads(uint32_t no_threads)
+{
+    if (no_threads > 0 && !hts_thread_pool.pool)
+        hts_thread_pool.pool = hts_tpool_init(no_threads);
+}
+
+// ************************************************************************************
+void CVCF::ReleaseThreads()
+{
+    if (hts_thread_pool.pool)
+    {
+        hts_tpool_destroy(hts_thread_pool.pool);
+        hts_thread_pool.pool = nullptr;
+    }
 }
 
 // ************************************************************************************
@@ -36,6 +64,8 @@ bool CVCF::OpenForReading(string & file_name)
     if(!vcf_file)
         return false;
     hts_set_opt(vcf_file, HTS_OPT_CACHE_SIZE, 32000000);
+    if(hts_thread_pool.pool)
+        hts_set_opt(vcf_file, HTS_OPT_THREAD_POOL, &hts_thread_pool);
     if(vcf_hdr)
         bcf_hdr_destroy(vcf_hdr);
     vcf_hdr = bcf_hdr_read(vcf_file);
@@ -58,6 +88,8 @@ bool CVCF::OpenForWriting(string & file_name, file_type type, char bcf_compressi
     if(!vcf_file)
         return false;
     hts_set_opt(vcf_file, HTS_OPT_CACHE_SIZE, 32000000);
+    if(hts_thread_pool.pool)
+        hts_set_opt(vcf_file, HTS_OPT_THREAD_POOL, &hts_thread_pool);
     rec = bcf_init();
     return true;
 }
@@ -257,9 +289,9 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
         desc.qual = '.';
     else
     {
-        kstring_t s = {0,0,0};
-        kputd(rec->qual, &s);
-        desc.qual += s.s;
+        ks_value.l = 0;
+        kputd(rec->qual, &ks_value);
+        desc.qual.append(ks_value.s, ks_value.l);
         
     }    
     
@@ -299,9 +331,9 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
                     case BCF_BT_INT16: if ( z->v1.i==bcf_int16_missing ) desc.info += '.'; else desc.info += to_string(z->v1.i); break;
                     case BCF_BT_INT32: if ( z->v1.i==bcf_int32_missing ) desc.info += '.'; else desc.info += to_string(z->v1.i); break;
                     case BCF_BT_FLOAT: if ( bcf_float_is_missing(z->v1.f) ) desc.info += '.'; else {
-                        kstring_t s = {0,0,0};
-                        kputd(z->v1.f, &s);
-                        desc.info += s.s;}
+                        ks_value.l = 0;
+                        kputd(z->v1.f, &ks_value);
+                        desc.info.append(ks_value.s, ks_value.l);}
                         break;
                     case BCF_BT_CHAR:  desc.info += z->v1.i; break;
                     default: hts_log_error("Unexpected type %d", z->type); exit(1); break;
@@ -309,9 +341,9 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
             }
             else
             {
-                kstring_t s_info = {0,0, nullptr};
-                bcf_fmt_array(&s_info, z->len, z->type, z->vptr);
-                desc.info += s_info.s;
+                ks_value.l = 0;
+                bcf_fmt_array(&ks_value, z->len, z->type, z->vptr);
+                desc.info.append(ks_value.s, ks_value.l);
             }
         }
         if ( first ) desc.info += '.';
@@ -319,8 +351,8 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
 
        
     //genotypes
-    int *gt_arr = NULL, ngt_arr = 0, ngt;
-    ngt = bcf_get_genotypes(vcf_hdr, rec, &gt_arr, &ngt_arr);
+    int ngt;
+    ngt = bcf_get_genotypes(vcf_hdr, rec, &gt_arr, &n_gt_arr);
     if (ngt <= 0 )
         return false; //genotype not present
     if(first_variant)
@@ -345,7 +377,7 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
     int allele;
     if(ploidy == 2) //ploidy = 2
     {
-        for(int i = 0; i < ngt_arr; i+=2)
+        for(int i = 0; i < ngt; i+=2)
         {
            
             allele = bcf_gt_allele(gt_arr[i]);
@@ -392,7 +424,7 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
     }
     else //if (ngt == bcf_hdr_nsamples(vcf_hdr)) //haploid
     {
-        for(int i = 0; i < ngt_arr; i++)
+        for(int i = 0; i < ngt; i++)
         {
             allele = bcf_gt_allele(gt_arr[i]);
             if(bcf_gt_is_missing(gt_arr[i]))
@@ -415,8 +447,6 @@ bool CVCF::GetVariant(variant_desc_t &desc, vector<uint8_t> &data)
         }
     }
 
-    free(gt_arr);
-    
     if(rec->n_allele > 2)
     {
         //if "ALT,<M>", do not add additional line(as VCF was already altered)
@@ -438,17 +468,46 @@ bool CVCF::SetVariant(variant_desc_t &desc, vector<uint8_t> &data)
 {
     bcf_clear(rec);
     
-    string record;
    // record = desc.chrom + "\t" + to_string(desc.pos) + "\t" + desc.id + "\t" + desc.ref + "\t" + desc.alt + "\t" + desc.qual +"\t" + desc.filter + "\t" + desc.info;
-    record = desc.chrom + "\t0\t" + desc.id + "\t" + desc.ref + "\t" + desc.alt + "\t" + desc.qual +"\t" + desc.filter + "\t" + desc.info;
+    // The record is built in place (no temporary strings)
+    record.assign(desc.chrom).append("\t0\t").append(desc.id).append(1, '\t').append(desc.ref).append(1, '\t').append(desc.alt).append(1, '\t')
+        .append(desc.qual).append(1, '\t').append(desc.filter).append(1, '\t').append(desc.info);
+
+    return write_record(desc.pos, data);
+}
+
+// ************************************************************************************
+bool CVCF::SetVariant(const variant_desc_view_t &desc, vector<uint8_t> &data)
+{
+    bcf_clear(rec);
+
+    // The record is built directly from the views
+    record.assign(desc.chrom.data, desc.chrom.size).append("\t0\t").append(desc.id.data, desc.id.size).append(1, '\t')
+        .append(desc.ref.data, desc.ref.size).append(1, '\t').append(desc.alt.data, desc.alt.size).append(1, '\t')
+        .append(desc.qual.data, desc.qual.size).append(1, '\t').append(desc.filter.data, desc.filter.size).append(1, '\t')
+        .append(desc.info.data, desc.info.size);
+
+    return write_record(desc.pos, data);
+}
+
+// ************************************************************************************
+// Parse the record text and store it with genotypes
+bool CVCF::write_record(int64_t pos, vector<uint8_t> &data)
+{
     kstring_t s;
     s.s = (char*)record.c_str();
     s.m = record.length();
     s.l = 0;
     vcf_parse(&s, vcf_hdr, rec);
-    rec->pos = (int32_t) (desc.pos - 1);
+    rec->pos = (int32_t) (pos - 1);
   
-    // GT
+    // GT (sites-only files have no samples)
+    if(bcf_hdr_nsamples(vcf_hdr) == 0)
+    {
+        bcf_write(vcf_file, vcf_hdr, rec);
+        return true;
+    }
+
     if(first_variant)
     {
         tmpia = new int[(bcf_hdr_nsamples(vcf_hdr)*sizeof(int))*2];
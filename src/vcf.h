@@ -65,6 +65,27 @@ typedef struct variant_desc_tag {
 	}
 } variant_desc_t;
 
+// Text of a field kept in a buffer of someone else
+typedef struct {
+	const char *data;
+	size_t size;
+} text_view_t;
+
+// Description of a variant made of views into decompressed description columns of a block (the columns must be kept by the user).
+// CHROM and FILTER are also given as ids in dictionaries of the block.
+typedef struct {
+	uint32_t chrom_id;
+	text_view_t chrom;
+	int64_t pos;
+	text_view_t id;
+	text_view_t ref;
+	text_view_t alt;
+	text_view_t qual;
+	uint32_t filter_id;
+	text_view_t filter;
+	text_view_t info;
+} variant_desc_view_t;
+
 class CVCF
 {
     htsFile * vcf_file;
@@ -76,10 +97,24 @@ class CVCF
     int curr_alt_number; //allela from ALT field (from 1)
     int32_t *tmpia; //to set genotypes in new variant    
 
+    // Buffers reused for all variants (no allocations per record)
+    int *gt_arr;
+    int n_gt_arr;
+    kstring_t ks_value;     // text of a QUAL or INFO value
+    string record;          // text of the record passed to vcf_parse
+
+    bool write_record(int64_t pos, vector<uint8_t> &data);
+
 public:
 	CVCF();
 	~CVCF();
 
+	// No. of threads of htslib pool shared by all files (for BGZF compression/decompression); must be set before opening files
+	static void SetNoThreads(uint32_t no_threads);
+
+	// Destroy the htslib pool (all files using it must be closed before)
+	static void ReleaseThreads();
+
 	// Open VCF file for reading
 	bool OpenForReading(string & file_name);
 
@@ -140,6 +175,9 @@ public:
 
 	// Store info about variant - parameters the same as for GetVariant
 	bool SetVariant(variant_desc_t &desc, vector<uint8_t> &data);
+
+	// Store info about variant given by views into description columns
+	bool SetVariant(const variant_desc_view_t &desc, vector<uint8_t> &data);
 	
 	// Get vector with sample names
 	bool GetSamplesList(vector<string> &s_list);
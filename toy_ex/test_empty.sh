@@ -0,0 +1,18 @@
+#!/bin/sh
+# Round trip of a VCF file with a header and no records (run within the toy_ex folder)
+GTSHARK=${1:-../gtshark}
+
+set -e
+rm -f toy_empty_archive_db toy_empty_archive_gt toy_empty_decomp.vcf toy_empty_stats.txt
+
+$GTSHARK compress-db toy_empty.vcf toy_empty_archive
+$GTSHARK decompress-db toy_empty_archive toy_empty_decomp.vcf
+$GTSHARK stats toy_empty_archive toy_empty_stats.txt
+
+test ! -s toy_empty_archive_gt
+test "`grep -vc '^##' toy_empty_decomp.vcf`" = 1
+grep -q '^#CHROM' toy_empty_decomp.vcf
+test "`wc -l < toy_empty_stats.txt`" = 1
+
+rm -f toy_empty_archive_db toy_empty_archive_gt toy_empty_decomp.vcf toy_empty_stats.txt
+echo "Empty VCF round trip: OK"